@@ -1,13 +1,46 @@
 #include "HttpClient.h"
 
+#include <ctype.h>
+
 static const uint16_t TIMEOUT = 5000; // Allow maximum 5s between data packets.
+static const uint16_t KEEP_ALIVE_TIMEOUT = 4000; // Reconnect after 4s idle, servers commonly close at 5s.
+static const uint16_t CONNECT_RETRY_DELAY = 10000; // Fail requests for 10s after a failed connect.
+static const uint16_t POLL_INTERVAL = 1; // Yield 1ms between polls of a blocking request.
 
 /**
 * Constructor.
 */
 HttpClient::HttpClient()
 {
-
+    headersTimeout = TIMEOUT;
+    bodyTimeout = TIMEOUT;
+    connectRetryDelay = CONNECT_RETRY_DELAY;
+    currentPhase = HTTP_IDLE;
+    currentRequest = NULL;
+    currentResponse = NULL;
+    currentHeaders = NULL;
+    currentMethod = NULL;
+    currentCallback = NULL;
+    currentContext = NULL;
+    reused = false;
+    retried = false;
+    received = 0;
+    bufferPosition = 0;
+    firstRead = 0;
+    lastRead = 0;
+    connectedPort = 0;
+    lastUsed = 0;
+    failedPort = 0;
+    failedAt = 0;
+    responseState = RESPONSE_DONE;
+    responseStatus = 0;
+    lineStart = 0;
+    headerLength = 0;
+    contentLength = -1;
+    chunkRemaining = 0;
+    chunkExtension = false;
+    chunked = false;
+    keepAlive = false;
 }
 
 /**
@@ -49,23 +82,71 @@ void HttpClient::sendHeader(const char* aHeaderName)
 }
 
 /**
-* Method to send an HTTP Request. Allocate variables in your application code
-* in the aResponse struct and set the headers and the options in the aRequest
-* struct.
+* Returns the value of a header line if it is the named header, NULL
+* otherwise. Header names are case-insensitive.
 */
-void HttpClient::request(http_request_t &aRequest, http_response_t &aResponse, http_header_t headers[], const char* aHttpMethod)
+static const char* headerValue(const char* aLine, const char* aHeaderName)
 {
-    // If a proper response code isn't received it will be set to -1.
-    aResponse.status = -1;
+    size_t length = strlen(aHeaderName);
+    if (strncasecmp(aLine, aHeaderName, length) != 0 || aLine[length] != ':') {
+        return NULL;
+    }
+    const char* value = aLine + length + 1;
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+    return value;
+}
 
+/**
+* Connects to the server of a request, reusing the open connection if it
+* goes to the same host and port and has not been idle for too long.
+*/
+bool HttpClient::connect(http_request_t &aRequest, bool &reused)
+{
     // NOTE: The default port tertiary statement is unpredictable if the request structure is not initialised
     // http_request_t request = {0} or memset(&request, 0, sizeof(http_request_t)) should be used
     // to ensure all fields are zero
+    int port = (aRequest.hostname!=NULL && !aRequest.port) ? 80 : aRequest.port;
+    bool sameServer = (aRequest.hostname!=NULL) ? (connectedHost == aRequest.hostname)
+                                                : (connectedHost.length() == 0 && connectedIp == aRequest.ip);
+    bool failedServer = (aRequest.hostname!=NULL) ? (failedHost == aRequest.hostname)
+                                                  : (failedHost.length() == 0 && failedIp == aRequest.ip);
+
+    // Bytes waiting on an idle connection mean it is out of step with the
+    // server, so it is not reused.
+    reused = false;
+    if (connectedPort != 0 && connectedPort == port && sameServer &&
+        client.connected() && !client.available() &&
+        millis() - lastUsed < KEEP_ALIVE_TIMEOUT) {
+        reused = true;
+
+        #ifdef LOGGING
+        Serial.println("HttpClient>\tReusing connection.");
+        #endif
+
+        return true;
+    }
+
+    client.stop();
+    connectedPort = 0;
+
+    // Connecting to an unreachable server blocks until TCPClient gives up,
+    // so it is not tried again before connectRetryDelay has passed.
+    if (failedPort != 0 && failedPort == port && failedServer &&
+        millis() - failedAt < connectRetryDelay) {
+        #ifdef LOGGING
+        Serial.println("HttpClient>\tConnection failed recently, not retrying yet.");
+        #endif
+
+        return false;
+    }
+
     bool connected = false;
     if(aRequest.hostname!=NULL) {
-        connected = client.connect(aRequest.hostname.c_str(), (aRequest.port) ? aRequest.port : 80 );
+        connected = client.connect(aRequest.hostname.c_str(), port);
     }   else {
-        connected = client.connect(aRequest.ip, aRequest.port);
+        connected = client.connect(aRequest.ip, port);
     }
 
     #ifdef LOGGING
@@ -78,7 +159,7 @@ void HttpClient::request(http_request_t &aRequest, http_response_t &aResponse, h
             Serial.print(aRequest.ip);
         }
         Serial.print(":");
-        Serial.println(aRequest.port);
+        Serial.println(port);
     } else {
         Serial.println("HttpClient>\tConnection failed.");
     }
@@ -86,32 +167,52 @@ void HttpClient::request(http_request_t &aRequest, http_response_t &aResponse, h
 
     if (!connected) {
         client.stop();
-        // If TCP Client can't connect to host, exit here.
-        return;
+        failedHost = (aRequest.hostname!=NULL) ? aRequest.hostname : String("");
+        failedIp = aRequest.ip;
+        failedPort = port;
+        failedAt = millis();
+        return false;
+    }
+    if (failedPort == port && failedServer) {
+        failedPort = 0;
     }
 
+    connectedHost = (aRequest.hostname!=NULL) ? aRequest.hostname : String("");
+    connectedIp = aRequest.ip;
+    connectedPort = port;
+    return true;
+}
+
+/**
+* Method to send the request line, headers and body.
+*/
+void HttpClient::sendRequest(http_request_t &aRequest, http_header_t headers[], const char* aHttpMethod)
+{
     //
     // Send HTTP Headers
     //
 
-    // Send initial headers (only HTTP 1.0 is supported for now).
+    // Send initial headers.
     client.print(aHttpMethod);
     client.print(" ");
     client.print(aRequest.path);
-    client.print(" HTTP/1.0\r\n");
+    client.print(" HTTP/1.1\r\n");
 
     #ifdef LOGGING
     Serial.println("HttpClient>\tStart of HTTP Request.");
     Serial.print(aHttpMethod);
     Serial.print(" ");
     Serial.print(aRequest.path);
-    Serial.print(" HTTP/1.0\r\n");
+    Serial.print(" HTTP/1.1\r\n");
     #endif
 
-    // Send General and Request Headers.
-    sendHeader("Connection", "close"); // Not supporting keep-alive for now.
+    // Send General and Request Headers. HTTP/1.1 requires a Host header.
+    sendHeader("Connection", "keep-alive");
     if(aRequest.hostname!=NULL) {
-        sendHeader("HOST", aRequest.hostname.c_str());
+        sendHeader("Host", aRequest.hostname.c_str());
+    } else {
+        client.print("Host: ");
+        client.println(aRequest.ip);
     }
 
     //Send Entity Headers
@@ -145,8 +246,10 @@ void HttpClient::request(http_request_t &aRequest, http_response_t &aResponse, h
     // Send HTTP Request Body
     //
 
+    // Exactly Content-Length bytes, anything more would be read by the
+    // server as the start of the next request on the connection.
     if (aRequest.body != NULL) {
-        client.println(aRequest.body);
+        client.print(aRequest.body);
 
         #ifdef LOGGING
         Serial.println(aRequest.body);
@@ -156,95 +259,353 @@ void HttpClient::request(http_request_t &aRequest, http_response_t &aResponse, h
     #ifdef LOGGING
     Serial.println("HttpClient>\tEnd of HTTP Request.");
     #endif
+}
+
+/**
+* Method to parse a header line for the framing of the response.
+*/
+void HttpClient::parseHeaderLine(const char* aLine)
+{
+    const char* value;
+    if ((value = headerValue(aLine, "Content-Length")) != NULL) {
+        contentLength = strtol(value, NULL, 10);
+    } else if ((value = headerValue(aLine, "Transfer-Encoding")) != NULL) {
+        chunked = strncasecmp(value, "chunked", 7) == 0;
+    } else if ((value = headerValue(aLine, "Connection")) != NULL) {
+        if (strncasecmp(value, "close", 5) == 0) {
+            keepAlive = false;
+        } else if (strncasecmp(value, "keep-alive", 10) == 0) {
+            keepAlive = true;
+        }
+    }
+}
+
+/**
+* Method to advance the response parser by one received character, stored
+* at position in buffer if it is kept. Returns true if the character is
+* kept: the status line, headers and body data, but not chunk framing.
+*/
+bool HttpClient::parseResponse(char c, unsigned int position)
+{
+    switch (responseState) {
+    case RESPONSE_STATUS:
+    case RESPONSE_HEADERS:
+        if (c != '\n') {
+            return true;
+        }
+        if (responseState == RESPONSE_STATUS) {
+            // HTTP/1.1 connections stay open unless the server says otherwise.
+            keepAlive = strncmp(&buffer[lineStart], "HTTP/1.1", 8) == 0;
+            responseStatus = atoi(&buffer[lineStart + 9]);
+            responseState = RESPONSE_HEADERS;
+        } else if (position - lineStart <= 1) {
+            // Empty line, the body follows. Chunked framing overrides
+            // Content-Length, and 204 and 304 responses have no body.
+            headerLength = position + 1;
+            if (responseStatus == 204 || responseStatus == 304) {
+                responseState = RESPONSE_DONE;
+            } else if (chunked) {
+                responseState = RESPONSE_CHUNK_SIZE;
+            } else if (contentLength == 0) {
+                responseState = RESPONSE_DONE;
+            } else {
+                // Without framing only the server closing the connection
+                // ends the body.
+                if (contentLength < 0) {
+                    keepAlive = false;
+                }
+                responseState = RESPONSE_BODY;
+            }
+        } else {
+            parseHeaderLine(&buffer[lineStart]);
+        }
+        lineStart = position + 1;
+        return true;
+
+    case RESPONSE_BODY:
+        if (contentLength >= 0 && position + 1 >= headerLength + contentLength) {
+            responseState = RESPONSE_DONE;
+        }
+        return true;
+
+    case RESPONSE_CHUNK_SIZE:
+        if (c == '\n') {
+            responseState = (chunkRemaining == 0) ? RESPONSE_TRAILERS : RESPONSE_CHUNK_DATA;
+        } else if (c == ';') {
+            chunkExtension = true;
+        } else if (!chunkExtension && isxdigit((unsigned char)c)) {
+            chunkRemaining = chunkRemaining * 16 + (isdigit((unsigned char)c) ? c - '0' : (c | 0x20) - 'a' + 10);
+        }
+        return false;
+
+    case RESPONSE_CHUNK_DATA:
+        if (--chunkRemaining == 0) {
+            responseState = RESPONSE_CHUNK_END;
+        }
+        return true;
+
+    case RESPONSE_CHUNK_END:
+        if (c == '\n') {
+            chunkExtension = false;
+            responseState = RESPONSE_CHUNK_SIZE;
+        }
+        return false;
+
+    case RESPONSE_TRAILERS:
+        // chunkRemaining, zero after the last chunk, counts the characters
+        // of the trailer line.
+        if (c == '\n') {
+            if (chunkRemaining == 0) {
+                responseState = RESPONSE_DONE;
+            }
+            chunkRemaining = 0;
+        } else if (c != '\r') {
+            chunkRemaining++;
+        }
+        return false;
+
+    case RESPONSE_DONE:
+        break;
+    }
+    return false;
+}
+
+/**
+* Method to start a request. Returns false if another one is in flight.
+*/
+bool HttpClient::startRequest(http_request_t &aRequest, http_response_t &aResponse, http_header_t headers[], const char* aHttpMethod, http_callback_t aCallback, void* aContext)
+{
+    if (currentPhase != HTTP_IDLE) {
+        return false;
+    }
+
+    // If a proper response code isn't received it will be set to -1.
+    aResponse.status = -1;
+    aResponse.body = "";
 
     // clear response buffer
     memset(&buffer[0], 0, sizeof(buffer));
+    responseState = RESPONSE_STATUS;
+
+    currentRequest = &aRequest;
+    currentResponse = &aResponse;
+    currentHeaders = headers;
+    currentMethod = aHttpMethod;
+    currentCallback = aCallback;
+    currentContext = aContext;
+    retried = false;
+    currentPhase = HTTP_CONNECT;
+    return true;
+}
 
+/**
+* Method to send an HTTP Request. Allocate variables in your application code
+* in the aResponse struct and set the headers and the options in the aRequest
+* struct. Blocks until the response is in. Fails at once with status -1 while
+* a request started asynchronously is in flight.
+*/
+void HttpClient::request(http_request_t &aRequest, http_response_t &aResponse, http_header_t headers[], const char* aHttpMethod)
+{
+    if (!startRequest(aRequest, aResponse, headers, aHttpMethod, NULL, NULL)) {
+        #ifdef LOGGING
+        Serial.println("HttpClient>\tError: Another request is in flight.");
+        #endif
+
+        aResponse.status = -1;
+        aResponse.body = "";
+        return;
+    }
+    while (poll()) {
+        delay(POLL_INTERVAL);
+    }
+}
+
+/**
+* Method to advance the request in flight by one phase step.
+*/
+bool HttpClient::poll()
+{
+    switch (currentPhase) {
+    case HTTP_IDLE:
+        return false;
+
+    case HTTP_CONNECT:
+        if (!connect(*currentRequest, reused)) {
+            // If TCP Client can't connect to host, the request fails here.
+            finishRequest();
+            return false;
+        }
+        currentPhase = HTTP_SEND;
+        return true;
+
+    case HTTP_SEND:
+        sendRequest(*currentRequest, currentHeaders, currentMethod);
+
+        memset(&buffer[0], 0, sizeof(buffer));
+        responseState = RESPONSE_STATUS;
+        responseStatus = 0;
+        lineStart = 0;
+        headerLength = 0;
+        contentLength = -1;
+        chunkRemaining = 0;
+        chunkExtension = false;
+        chunked = false;
+        keepAlive = false;
+        received = 0;
+        bufferPosition = 0;
+        firstRead = millis();
+        lastRead = millis();
+        currentPhase = HTTP_HEADERS;
+        return true;
+
+    case HTTP_HEADERS:
+    case HTTP_BODY:
+        return receiveResponse();
+    }
+    return false;
+}
 
+/**
+* Method to receive what has arrived of the response into buffer. Returns
+* true while more is expected.
+*/
+bool HttpClient::receiveResponse()
+{
     //
     // Receive HTTP Response
     //
-    // The first value of client.available() might not represent the
-    // whole response, so after the first chunk of data is received instead
-    // of terminating the connection there is a delay and another attempt
-    // to read data.
-    // The loop exits when the connection is closed, or if there is a
-    // timeout or an error.
-
-    unsigned int bufferPosition = 0;
-    unsigned long lastRead = millis();
-    unsigned long firstRead = millis();
+    // The status line and headers are parsed as they arrive, so the request
+    // finishes as soon as the whole response is in. It also finishes when
+    // the connection is closed, or if there is a timeout or an error.
+
     bool error = false;
-    bool timeout = false;
 
-    do {
-        #ifdef LOGGING
-        int bytes = client.available();
-        if(bytes) {
-            Serial.print("\r\nHttpClient>\tReceiving TCP transaction of ");
-            Serial.print(bytes);
-            Serial.println(" bytes.");
+    #ifdef LOGGING
+    int bytes = client.available();
+    if(bytes) {
+        Serial.print("\r\nHttpClient>\tReceiving TCP transaction of ");
+        Serial.print(bytes);
+        Serial.println(" bytes.");
+    }
+    #endif
+
+    while (responseState != RESPONSE_DONE && client.available()) {
+        int c = client.read();
+        lastRead = millis();
+
+        if (c == -1) {
+            error = true;
+
+            #ifdef LOGGING
+            Serial.println("HttpClient>\tError: No data available.");
+            #endif
+
+            break;
         }
+        #ifdef LOGGING
+        Serial.print((char)c);
         #endif
+        received++;
+
+        if (!parseResponse(c, bufferPosition)) {
+            continue;
+        }
+        // Check that received character fits in buffer before storing.
+        if (bufferPosition == sizeof(buffer)-1) {
+            client.stop();
+            error = true;
 
-        while (client.available()) {
-            char c = client.read();
             #ifdef LOGGING
-            Serial.print(c);
+            Serial.println("HttpClient>\tError: Response body larger than buffer.");
             #endif
-            lastRead = millis();
 
-            if (c == -1) {
-                error = true;
+            break;
+        }
+        buffer[bufferPosition++] = c;
+    }
+    buffer[bufferPosition] = '\0'; // Null-terminate buffer
 
-                #ifdef LOGGING
-                Serial.println("HttpClient>\tError: No data available.");
-                #endif
+    #ifdef LOGGING
+    if (bytes) {
+        Serial.print("\r\nHttpClient>\tEnd of TCP transaction.");
+    }
+    #endif
 
-                break;
-            }
+    if (responseState > RESPONSE_HEADERS) {
+        currentPhase = HTTP_BODY;
+    }
+    if (responseState == RESPONSE_DONE || error) {
+        finishRequest();
+        return false;
+    }
 
-            // Check that received character fits in buffer before storing.
-            if (bufferPosition < sizeof(buffer)-1) {
-                buffer[bufferPosition] = c;
-            } else if ((bufferPosition == sizeof(buffer)-1)) {
-                buffer[bufferPosition] = '\0'; // Null-terminate buffer
-                client.stop();
-                error = true;
-
-                #ifdef LOGGING
-                Serial.println("HttpClient>\tError: Response body larger than buffer.");
-                #endif
-            }
-            bufferPosition++;
+    if (!client.connected()) {
+        // The server may close an idle connection just as it is reused,
+        // which only shows once the request has been sent. Then a GET is
+        // sent once more on a new connection. Other methods fail instead:
+        // the server may have acted on the request before closing, e.g. a
+        // POST would be stored twice.
+        if (received == 0 && reused && !retried &&
+            strcmp(currentMethod, HTTP_METHOD_GET) == 0) {
+            #ifdef LOGGING
+            Serial.println("HttpClient>\tStale connection, reconnecting.");
+            #endif
+
+            client.stop();
+            connectedPort = 0;
+            retried = true;
+            currentPhase = HTTP_CONNECT;
+            return true;
         }
-        buffer[bufferPosition] = '\0'; // Null-terminate buffer
 
-        #ifdef LOGGING
-        if (bytes) {
-            Serial.print("\r\nHttpClient>\tEnd of TCP transaction.");
+        // A body that ends with the connection is complete once it closes.
+        if (responseState == RESPONSE_BODY && contentLength < 0) {
+            responseState = RESPONSE_DONE;
         }
+        finishRequest();
+        return false;
+    }
+
+    // Check that the phase has not waited too long for data.
+    unsigned long timeout = (currentPhase == HTTP_HEADERS) ? headersTimeout : bodyTimeout;
+    if (millis() - lastRead > timeout) {
+        #ifdef LOGGING
+        Serial.println("\r\nHttpClient>\tError: Timeout while reading response.");
         #endif
 
-        // Check that there hasn't been more than 5s since last read.
-        timeout = millis() - lastRead > TIMEOUT;
+        finishRequest();
+        return false;
+    }
+    return true;
+}
 
-        // Unless there has been an error or timeout wait 200ms to allow server
-        // to respond or close connection.
-        if (!error && !timeout) {
-            delay(200);
-        }
-    } while (client.connected() && !timeout && !error);
+/**
+* Method to fill in the response of the request in flight and call its
+* callback.
+*/
+void HttpClient::finishRequest()
+{
+    http_response_t &aResponse = *currentResponse;
+    http_callback_t callback = currentCallback;
+    void* context = currentContext;
 
     #ifdef LOGGING
-    if (timeout) {
-        Serial.println("\r\nHttpClient>\tError: Timeout while reading response.");
-    }
     Serial.print("\r\nHttpClient>\tEnd of HTTP Response (");
     Serial.print(millis() - firstRead);
     Serial.println("ms).");
     #endif
-    client.stop();
+
+    // Bytes past the end of the response are left unread and keep the
+    // connection from being reused, see connect().
+    if (responseState == RESPONSE_DONE && keepAlive) {
+        lastUsed = millis();
+    } else {
+        client.stop();
+        connectedPort = 0;
+    }
+
+    // The callback may start the next request.
+    currentPhase = HTTP_IDLE;
 
     String raw_response(buffer);
 
@@ -256,16 +617,24 @@ void HttpClient::request(http_request_t &aRequest, http_response_t &aResponse, h
     Serial.println(statusCode);
     #endif
 
+    // A response cut short by a timeout or an error keeps status -1.
     int bodyPos = raw_response.indexOf("\r\n\r\n");
     if (bodyPos == -1) {
         #ifdef LOGGING
         Serial.println("HttpClient>\tError: Can't find HTTP response body.");
         #endif
+    } else if (responseState != RESPONSE_DONE) {
+        #ifdef LOGGING
+        Serial.println("HttpClient>\tError: Incomplete HTTP response.");
+        #endif
+    } else {
+        // Return the entire message body from bodyPos+4 till end.
+        aResponse.body = "";
+        aResponse.body += raw_response.substring(bodyPos+4);
+        aResponse.status = atoi(statusCode.c_str());
+    }
 
-        return;
+    if (callback != NULL) {
+        callback(aResponse, context);
     }
-    // Return the entire message body from bodyPos+4 till end.
-    aResponse.body = "";
-    aResponse.body += raw_response.substring(bodyPos+4);
-    aResponse.status = atoi(statusCode.c_str());
 }
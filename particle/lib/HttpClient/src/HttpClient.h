@@ -54,6 +54,26 @@ typedef struct
   String body;
 } http_response_t;
 
+/**
+ * Phases of an asynchronous request, see HttpClient::poll().
+ */
+typedef enum
+{
+  HTTP_IDLE,     // no request in flight
+  HTTP_CONNECT,  // connecting, or reusing the open connection
+  HTTP_SEND,     // sending the request
+  HTTP_HEADERS,  // waiting for the status line and headers
+  HTTP_BODY      // receiving the body
+} http_phase_t;
+
+/**
+ * Completion callback of an asynchronous request, called by poll() when the
+ * response is in or the request failed. aResponse.status is -1 if the request
+ * failed or a phase timed out. aContext is the pointer passed when the request
+ * was started.
+ */
+typedef void (*http_callback_t)(http_response_t &aResponse, void* aContext);
+
 class HttpClient {
 public:
     /**
@@ -62,6 +82,20 @@ public:
     TCPClient client;
     char buffer[1024];
 
+    /**
+    * Per-phase timeouts in ms: the longest wait without receiving data,
+    * for the headers and for the body. 5s by default.
+    */
+    unsigned long headersTimeout;
+    unsigned long bodyTimeout;
+
+    /**
+    * After a failed connect, requests to the same server fail at once for
+    * this many ms instead of blocking in TCPClient::connect() again. 10s by
+    * default, 0 tries every time.
+    */
+    unsigned long connectRetryDelay;
+
     /**
     * Constructor.
     */
@@ -116,14 +150,149 @@ public:
         request(aRequest, aResponse, headers, HTTP_METHOD_PATCH);
     }
 
+    /**
+    * Asynchronous HTTP request methods. They start the request and return
+    * at once; poll() then drives it and calls aCallback with the response.
+    * aRequest, aResponse and headers must stay valid until then. Only one
+    * request is in flight at a time: they return false if one already is.
+    */
+    bool getAsync(http_request_t &aRequest, http_response_t &aResponse, http_header_t headers[], http_callback_t aCallback, void* aContext = NULL)
+    {
+        return startRequest(aRequest, aResponse, headers, HTTP_METHOD_GET, aCallback, aContext);
+    }
+
+    bool postAsync(http_request_t &aRequest, http_response_t &aResponse, http_header_t headers[], http_callback_t aCallback, void* aContext = NULL)
+    {
+        return startRequest(aRequest, aResponse, headers, HTTP_METHOD_POST, aCallback, aContext);
+    }
+
+    bool putAsync(http_request_t &aRequest, http_response_t &aResponse, http_header_t headers[], http_callback_t aCallback, void* aContext = NULL)
+    {
+        return startRequest(aRequest, aResponse, headers, HTTP_METHOD_PUT, aCallback, aContext);
+    }
+
+    bool delAsync(http_request_t &aRequest, http_response_t &aResponse, http_header_t headers[], http_callback_t aCallback, void* aContext = NULL)
+    {
+        return startRequest(aRequest, aResponse, headers, HTTP_METHOD_DELETE, aCallback, aContext);
+    }
+
+    bool patchAsync(http_request_t &aRequest, http_response_t &aResponse, http_header_t headers[], http_callback_t aCallback, void* aContext = NULL)
+    {
+        return startRequest(aRequest, aResponse, headers, HTTP_METHOD_PATCH, aCallback, aContext);
+    }
+
+    /**
+    * Advances the request in flight by one phase step: connecting, sending,
+    * or reading what has arrived. Call it from loop(). Connecting blocks in
+    * TCPClient::connect(), which has no timeout of its own here; with
+    * keep-alive that only happens for the first request to a server or after
+    * the connection closed, and at most once per connectRetryDelay while the
+    * server is unreachable. Sending blocks only while the socket's send
+    * buffer is full, i.e. for requests larger than the buffer.
+    * Returns true while the request is in flight.
+    */
+    bool poll();
+
+    /**
+    * Phase of the request in flight, HTTP_IDLE if there is none.
+    */
+    http_phase_t phase() const
+    {
+        return currentPhase;
+    }
+
+    bool busy() const
+    {
+        return currentPhase != HTTP_IDLE;
+    }
+
 private:
     /**
     * Underlying HTTP methods.
     */
     void request(http_request_t &aRequest, http_response_t &aResponse, http_header_t headers[], const char* aHttpMethod);
+    bool startRequest(http_request_t &aRequest, http_response_t &aResponse, http_header_t headers[], const char* aHttpMethod, http_callback_t aCallback, void* aContext);
+    bool connect(http_request_t &aRequest, bool &reused);
+    void sendRequest(http_request_t &aRequest, http_header_t headers[], const char* aHttpMethod);
+    bool receiveResponse();
+    void finishRequest();
+    bool parseResponse(char c, unsigned int position);
+    void parseHeaderLine(const char* aLine);
     void sendHeader(const char* aHeaderName, const char* aHeaderValue);
     void sendHeader(const char* aHeaderName, const int aHeaderValue);
     void sendHeader(const char* aHeaderName);
+
+    /**
+    * Persistent connection (HTTP/1.1 keep-alive). The connection is reused
+    * by the next request to the same host and port, unless it has been idle
+    * for KEEP_ALIVE_TIMEOUT or the server asked to close it.
+    */
+    String connectedHost;
+    IPAddress connectedIp;
+    int connectedPort;
+    unsigned long lastUsed;
+
+    /**
+    * Server of the last failed connect, failedPort is 0 if there is none.
+    */
+    String failedHost;
+    IPAddress failedIp;
+    int failedPort;
+    unsigned long failedAt;
+
+    /**
+    * Request in flight, see startRequest().
+    * reused        it went out on a kept-alive connection
+    * retried       it has been sent again after such a connection closed,
+    *               which is only done for GET
+    * received      bytes of response received, bufferPosition of them kept
+    */
+    http_phase_t currentPhase;
+    http_request_t* currentRequest;
+    http_response_t* currentResponse;
+    http_header_t* currentHeaders;
+    const char* currentMethod;
+    http_callback_t currentCallback;
+    void* currentContext;
+    bool reused;
+    bool retried;
+    unsigned int received;
+    unsigned int bufferPosition;
+    unsigned long firstRead;
+    unsigned long lastRead;
+
+    /**
+    * Response parser, fed one character at a time as they are received.
+    * Chunked bodies are stored in buffer without their chunk framing.
+    */
+    enum ResponseState {
+        RESPONSE_STATUS,      // status line
+        RESPONSE_HEADERS,     // header lines up to the empty line
+        RESPONSE_BODY,        // Content-Length bytes, or until the server closes
+        RESPONSE_CHUNK_SIZE,  // hexadecimal chunk size line
+        RESPONSE_CHUNK_DATA,  // chunkRemaining bytes of data
+        RESPONSE_CHUNK_END,   // CRLF after the chunk data
+        RESPONSE_TRAILERS,    // trailer lines after the last chunk
+        RESPONSE_DONE
+    };
+
+    /**
+    * Parser state.
+    * lineStart     buffer position of the line being received
+    * headerLength  bytes up to and including the empty line
+    * contentLength body length, -1 if the server did not send it
+    * chunked       Transfer-Encoding: chunked
+    * keepAlive     the server keeps the connection open after the response
+    */
+    ResponseState responseState;
+    int responseStatus;
+    unsigned int lineStart;
+    unsigned int headerLength;
+    long contentLength;
+    unsigned long chunkRemaining;
+    bool chunkExtension;
+    bool chunked;
+    bool keepAlive;
 };
 
 #endif /* __HTTP_CLIENT_H_ */
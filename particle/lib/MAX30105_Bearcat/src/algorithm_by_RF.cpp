@@ -34,15 +34,101 @@
 #include "algorithm_by_RF.h"
 #include <math.h>
 
+// State used by the non-reentrant entry point, rf_heart_rate_and_oxygen_saturation(). It is set up by
+// rf_init_state() on the first call, so that the cold-start values live in one place.
+static rf_state_t rf_default_state;
+static bool rf_default_state_ready=false;
+static rf_workspace_t rf_default_workspace;
+
+void rf_init_state(rf_state_t *p_state)
+/**
+* \brief        Initialize estimator state
+* \par          Details
+*               Puts the estimator into its cold-start condition, so that the next call runs
+*               the full initial periodicity search.
+*
+* \param[out]   *p_state                 - Estimator state to initialize
+*
+* \retval       None
+*/
+{
+  p_state->n_last_peak_interval=LOWEST_PERIOD;
+  p_state->f_last_peak_interval=LOWEST_PERIOD;
+  p_state->f_heart_rate=-999.0;
+  p_state->uch_last_screen=RF_SCREEN_OK;
+  p_state->un_batches=0;
+  p_state->un_rejected=0;
+  p_state->f_track_lag=0.0;
+  p_state->f_track_rate=0.0;
+  p_state->f_track_band=0.0;
+  p_state->uch_track_misses=0;
+  p_state->uch_track_age=0;
+}
+
+int8_t rf_warm_start(rf_state_t *p_state, float f_lag)
+/**
+* \brief        Initialize estimator state from a previous session
+* \par          Details
+*               Like rf_init_state(), but with the heart rate tracker locked on f_lag, the peak lag of the
+*               last valid batch of an earlier session, e.g. one kept in retained memory across sleep or a
+*               reset. The first batch then searches track_band_warm lags around it instead of running the
+*               full initial scan. If the pulse has moved further, the usual tracker misses widen the band
+*               and eventually drop the lock. An f_lag outside LOWEST_PERIOD..HIGHEST_PERIOD, as found in
+*               uninitialized memory, gives a cold start.
+*
+* \param[out]   *p_state                 - Estimator state to initialize
+* \param[in]    f_lag                    - Peak lag in samples, as left in f_last_peak_interval
+*
+* \retval       1 if the state was warm started, 0 if it was cold started
+*/
+{
+  rf_init_state(p_state);
+  if(!(f_lag>=LOWEST_PERIOD && f_lag<=HIGHEST_PERIOD)) return 0;
+  p_state->n_last_peak_interval=(int32_t)(f_lag+0.5);
+  p_state->f_last_peak_interval=f_lag;
+  p_state->f_track_lag=f_lag;
+  p_state->f_track_band=track_band_warm;
+  return 1;
+}
+
 void rf_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, float *pn_spo2, int8_t *pch_spo2_valid, 
                 int32_t *pn_heart_rate, int8_t *pch_hr_valid, float *ratio, float *correl)
 /**
+* \brief        Calculate the heart rate and SpO2 level using a single, shared estimator state
+* \par          Details
+*               Kept for existing callers. Not reentrant: every call shares one state, so results depend
+*               on whatever was processed before. Use rf_heart_rate_and_oxygen_saturation_r() instead.
+*
+* \retval       None
+*/
+{
+  if(!rf_default_state_ready) {
+    rf_init_state(&rf_default_state);
+    rf_default_state_ready=true;
+  }
+  rf_heart_rate_and_oxygen_saturation_r(&rf_default_state, &rf_default_workspace, pun_ir_buffer, n_ir_buffer_length, pun_red_buffer, pn_spo2, pch_spo2_valid, 
+                pn_heart_rate, pch_hr_valid, ratio, correl);
+}
+
+void rf_heart_rate_and_oxygen_saturation_r(rf_state_t *p_state, rf_workspace_t *p_work, uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, float *pn_spo2, 
+                int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid, float *ratio, float *correl)
+/**
 * \brief        Calculate the heart rate and SpO2 level, Robert Fraczkiewicz version
 * \par          Details
 *               By detecting  peaks of PPG cycle and corresponding AC/DC of red/infra-red signal, the xy_ratio for the SPO2 is computed.
+*               All cross-batch tracking lives in *p_state, so independent estimators may run concurrently.
+*               Intermediate signals are kept in *p_work instead of on the stack, and stay there for derived metrics.
+*               The autocorrelation peak is interpolated to a fraction of a lag, so heart rate is not quantized
+*               to FS60/integer and shorter batches still give stable readings. The fractional rate is left
+*               in p_state->f_heart_rate; *pn_heart_rate is that rate rounded to the nearest bpm.
+*               Hopeless batches are rejected by rf_prescreen() first; the reason is left in p_state->uch_last_screen.
+*               While the heart rate tracker is locked, the periodicity search is bounded to the predicted band,
+*               with a periodic or low-ratio full search to escape a lock on a harmonic of the pulse.
 *
+* \param[in,out] *p_state                - Estimator state, see rf_init_state()
+* \param[in]    *p_work                  - Workspace of RF_WORKSPACE_SIZE bytes, contents are overwritten
 * \param[in]    *pun_ir_buffer           - IR sensor data buffer
-* \param[in]    n_ir_buffer_length      - IR sensor data buffer length
+* \param[in]    n_ir_buffer_length      - IR sensor data buffer length, at most RFA_BUFFER_SIZE
 * \param[in]    *pun_red_buffer          - Red sensor data buffer
 * \param[out]    *pn_spo2                - Calculated SpO2 value
 * \param[out]    *pch_spo2_valid         - 1 if the calculated SpO2 value is valid
@@ -52,13 +138,37 @@ void rf_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_ir_b
 * \retval       None
 */
 {
-  int32_t k;  
-  static int32_t n_last_peak_interval=LOWEST_PERIOD;
-  float f_ir_mean,f_red_mean,f_ir_sumsq,f_red_sumsq;
+  int32_t k, n_min_lag, n_max_lag, n_full_lag;  
+  float f_ir_mean,f_red_mean,f_ir_sumsq,f_red_sumsq,f_full_ratio;
   float f_y_ac, f_x_ac, xy_ratio;
   float beta_ir, beta_red, x;
-  float an_x[RFA_BUFFER_SIZE], *ptr_x; //ir
-  float an_y[RFA_BUFFER_SIZE], *ptr_y; //red
+  float f_x_mean, f_sum_x2;
+  float *an_x=p_work->an_x, *ptr_x; //ir
+  float *an_y=p_work->an_y, *ptr_y; //red
+
+  p_work->n_size=0;
+  if(n_ir_buffer_length>RFA_BUFFER_SIZE) {
+    *pn_heart_rate = -999; // batch does not fit into the workspace
+    *pch_hr_valid  = 0;
+    *pn_spo2 =  -999 ;
+    *pch_spo2_valid  = 0; 
+    return;
+  }
+
+  // Reject finger-off, saturated, flat and aperiodic batches before doing any real work
+  p_state->un_batches++;
+  p_state->uch_last_screen=rf_prescreen(pun_ir_buffer, pun_red_buffer, n_ir_buffer_length);
+  if(p_state->uch_last_screen!=RF_SCREEN_OK) {
+    p_state->un_rejected++;
+    rf_track_miss(p_state);
+    *ratio = 0.0;
+    *correl = 0.0;
+    *pn_heart_rate = -999;
+    *pch_hr_valid  = 0;
+    *pn_spo2 =  -999 ;
+    *pch_spo2_valid  = 0; 
+    return;
+  }
 
   // calculates DC mean and subtracts DC from ir and red
   f_ir_mean=0.0; 
@@ -76,10 +186,14 @@ void rf_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_ir_b
     *ptr_y = pun_red_buffer[k] - f_red_mean;
   }
 
+  // Mean and sum of squares of the centered sample indices. For a full batch these equal mean_X and sum_X2.
+  f_x_mean=(float)(n_ir_buffer_length-1)/2.0;
+  f_sum_x2=(float)n_ir_buffer_length*((float)n_ir_buffer_length*n_ir_buffer_length-1.0)/12.0;
+
   // RF, remove linear trend (baseline leveling)
-  beta_ir = rf_linear_regression_beta(an_x, mean_X, sum_X2);
-  beta_red = rf_linear_regression_beta(an_y, mean_X, sum_X2);
-  for(k=0,x=-mean_X,ptr_x=an_x,ptr_y=an_y; k<n_ir_buffer_length; ++k,++x,++ptr_x,++ptr_y) {
+  beta_ir = rf_linear_regression_beta(an_x, f_x_mean, f_sum_x2);
+  beta_red = rf_linear_regression_beta(an_y, f_x_mean, f_sum_x2);
+  for(k=0,x=-f_x_mean,ptr_x=an_x,ptr_y=an_y; k<n_ir_buffer_length; ++k,++x,++ptr_x,++ptr_y) {
     *ptr_x -= beta_ir*x;
     *ptr_y -= beta_red*x;
   }
@@ -88,26 +202,64 @@ void rf_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_ir_b
   f_y_ac=rf_rms(an_y,n_ir_buffer_length,&f_red_sumsq);
   f_x_ac=rf_rms(an_x,n_ir_buffer_length,&f_ir_sumsq);
 
+  // Keep the intermediates for derived metrics
+  p_work->n_size=n_ir_buffer_length;
+  p_work->f_ir_dc=f_ir_mean;
+  p_work->f_red_dc=f_red_mean;
+  p_work->f_ir_beta=beta_ir;
+  p_work->f_red_beta=beta_red;
+  p_work->f_ir_ac=f_x_ac;
+  p_work->f_red_ac=f_y_ac;
+
   // Calculate Pearson correlation between red and IR
   *correl=rf_Pcorrelation(an_x, an_y, n_ir_buffer_length)/sqrt(f_red_sumsq*f_ir_sumsq);
 
   // Find signal periodicity
-  if(*correl>=min_pearson_correlation) {
+  if(*correl>=min_pearson_correlation && p_state->f_track_lag>0.0) {
+    // Tracker is locked. Climb to the nearest autocorrelation peak from the predicted lag, without leaving the band.
+    x=p_state->f_track_lag+p_state->f_track_rate;
+    n_min_lag=(int32_t)floor(x-p_state->f_track_band);
+    n_max_lag=(int32_t)ceil(x+p_state->f_track_band);
+    if(n_min_lag<LOWEST_PERIOD) n_min_lag=LOWEST_PERIOD;
+    if(n_max_lag>HIGHEST_PERIOD) n_max_lag=HIGHEST_PERIOD;
+    p_state->n_last_peak_interval=(int32_t)(x+0.5);
+    if(p_state->n_last_peak_interval<n_min_lag) p_state->n_last_peak_interval=n_min_lag;
+    if(p_state->n_last_peak_interval>n_max_lag) p_state->n_last_peak_interval=n_max_lag;
+    rf_signal_periodicity(an_x, n_ir_buffer_length, &p_state->n_last_peak_interval, n_min_lag, n_max_lag, min_autocorrelation_ratio, f_ir_sumsq, ratio);
+    // Check the lock against the full scan now and then, or when the band holds no convincing peak
+    if(++p_state->uch_track_age>=TRACK_RESEARCH_BATCHES || p_state->n_last_peak_interval==0 || *ratio<track_research_ratio) {
+      p_state->uch_track_age=0;
+      n_full_lag=LOWEST_PERIOD;
+      rf_initialize_periodicity_search(an_x, n_ir_buffer_length, &n_full_lag, HIGHEST_PERIOD, min_autocorrelation_ratio, f_ir_sumsq);
+      if(n_full_lag!=0)
+        rf_signal_periodicity(an_x, n_ir_buffer_length, &n_full_lag, LOWEST_PERIOD, HIGHEST_PERIOD, min_autocorrelation_ratio, f_ir_sumsq, &f_full_ratio);
+      if(n_full_lag!=0 && (n_full_lag<n_min_lag || n_full_lag>n_max_lag || p_state->n_last_peak_interval==0)) {
+        // A first peak outside the band means the tracker was locked on a harmonic. Lock again on the first peak.
+        if(n_full_lag<n_min_lag || n_full_lag>n_max_lag) p_state->f_track_lag=0.0;
+        p_state->n_last_peak_interval=n_full_lag;
+        *ratio=f_full_ratio;
+      }
+    }
+  } else if(*correl>=min_pearson_correlation) {
     // At the beginning of oximetry run the exact range of heart rate is unknown. This may lead to wrong rate if the next call does not find the _first_
     // peak of the autocorrelation function. E.g., second peak would yield only 50% of the true rate. 
-    if(LOWEST_PERIOD==n_last_peak_interval) 
-      rf_initialize_periodicity_search(an_x, RFA_BUFFER_SIZE, &n_last_peak_interval, HIGHEST_PERIOD, min_autocorrelation_ratio, f_ir_sumsq);
+    if(LOWEST_PERIOD==p_state->n_last_peak_interval) 
+      rf_initialize_periodicity_search(an_x, n_ir_buffer_length, &p_state->n_last_peak_interval, HIGHEST_PERIOD, min_autocorrelation_ratio, f_ir_sumsq);
     // RF, If correlation os good, then find average periodicity of the IR signal. If aperiodic, return periodicity of 0
-    if(n_last_peak_interval!=0)
-      rf_signal_periodicity(an_x, RFA_BUFFER_SIZE, &n_last_peak_interval, LOWEST_PERIOD, HIGHEST_PERIOD, min_autocorrelation_ratio, f_ir_sumsq, ratio);
-  } else n_last_peak_interval=0;
+    if(p_state->n_last_peak_interval!=0)
+      rf_signal_periodicity(an_x, n_ir_buffer_length, &p_state->n_last_peak_interval, LOWEST_PERIOD, HIGHEST_PERIOD, min_autocorrelation_ratio, f_ir_sumsq, ratio);
+  } else p_state->n_last_peak_interval=0;
 
   // Calculate heart rate if periodicity detector was successful. Otherwise, reset peak interval to its initial value and report error.
-  if(n_last_peak_interval!=0) {
-    *pn_heart_rate = (int32_t)(FS60/n_last_peak_interval);
+  if(p_state->n_last_peak_interval!=0) {
+    // At the peak lag, autocorrelation equals ratio times its value at lag 0
+    p_state->f_last_peak_interval=rf_interpolate_peak_lag(an_x, n_ir_buffer_length, p_state->n_last_peak_interval, (*ratio)*f_ir_sumsq);
+    p_state->f_heart_rate=FS60/p_state->f_last_peak_interval;
+    rf_track_hit(p_state, p_state->f_last_peak_interval);
+    *pn_heart_rate = (int32_t)(p_state->f_heart_rate+0.5);
     *pch_hr_valid  = 1;
   } else {
-    n_last_peak_interval=LOWEST_PERIOD;
+    rf_track_miss(p_state);
     *pn_heart_rate = -999; // unable to calculate because signal looks aperiodic
     *pch_hr_valid  = 0;
     *pn_spo2 =  -999 ; // do not use SPO2 from this corrupt signal
@@ -126,12 +278,225 @@ void rf_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_ir_b
   }
 }
 
+int8_t rf_adaptive_window_r(rf_state_t *p_state, rf_workspace_t *p_work, uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, float *pn_spo2, 
+                int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid, float *ratio, float *correl)
+/**
+* \brief        Calculate the heart rate and SpO2 level on a batch that grows until the signal is convincing
+* \par          Details
+*               Call with the first RF_MIN_WINDOW samples of a recording, then again every RF_WINDOW_STEP samples
+*               for as long as it returns 0. The batch is evaluated like rf_heart_rate_and_oxygen_saturation_r(),
+*               but on a copy of *p_state. A marginal result, see window_pearson_margin and
+*               window_autocorrelation_margin, is discarded so that the longer batch starts from the same state.
+*               Only the pre-screen statistics of the discarded evaluation are kept, see rf_rejection_rate().
+*               A convincing result, a batch rejected for finger-off, saturation or a flat signal, and any result
+*               once the next step would exceed RFA_BUFFER_SIZE are final: the state is committed and the
+*               outputs hold the result. n_ir_buffer_length is then the window length actually used.
+*
+* \retval       1 if the outputs are final, 0 if the batch should be extended by RF_WINDOW_STEP samples
+*/
+{
+  rf_state_t trial=*p_state;
+  uint8_t uch_screen;
+
+  *ratio=0.0;
+  *correl=0.0;
+  rf_heart_rate_and_oxygen_saturation_r(&trial, p_work, pun_ir_buffer, n_ir_buffer_length, pun_red_buffer, pn_spo2, 
+                pch_spo2_valid, pn_heart_rate, pch_hr_valid, ratio, correl);
+  uch_screen=trial.uch_last_screen;
+  if(n_ir_buffer_length+RF_WINDOW_STEP<=RFA_BUFFER_SIZE && (uch_screen==RF_SCREEN_OK || uch_screen==RF_SCREEN_APERIODIC)) {
+    if(!*pch_hr_valid || !*pch_spo2_valid || *correl<min_pearson_correlation+window_pearson_margin ||
+       *ratio<min_autocorrelation_ratio+window_autocorrelation_margin) {
+      // Marginal: keep the state, but count the pre-screen of this evaluation
+      p_state->uch_last_screen=trial.uch_last_screen;
+      p_state->un_batches=trial.un_batches;
+      p_state->un_rejected=trial.un_rejected;
+      return 0;
+    }
+  }
+  *p_state=trial;
+  return 1;
+}
+
+int8_t rf_provisional_heart_rate(rf_workspace_t *p_work, uint32_t *pun_ir_buffer, int32_t n_size, float *pf_heart_rate, float *ratio)
+/**
+* \brief        Provisional heart rate from a batch that is still filling up
+* \par          Details
+*               Detrends the IR signal and looks for the first autocorrelation peak at lags up to n_size/2,
+*               so that at least two periods of the pulse lie in the batch. Needs no more than 2*LOWEST_PERIOD
+*               samples for the fastest pulse, and about two periods in general. Neither the estimator state
+*               nor SpO2 are involved: the result is meant to be replaced by the one of
+*               rf_adaptive_window_r() once the batch is long enough. Less than a beat of signal can correlate
+*               well at a short lag, so callers should only trust a value that a longer batch confirms.
+*
+* \param[in]    *p_work                  - Workspace of RF_WORKSPACE_SIZE bytes, contents are overwritten
+* \param[in]    *pun_ir_buffer           - IR sensor data buffer
+* \param[in]    n_size                   - Samples collected so far, at most RFA_BUFFER_SIZE
+* \param[out]   *pf_heart_rate           - Provisional heart rate in bpm, -999 if none was found
+* \param[out]   *ratio                   - Autocorrelation ratio at the peak
+*
+* \retval       1 if a provisional heart rate was found
+*/
+{
+  int32_t k, n_lag, n_max_lag;
+  float f_ir_mean, f_ir_sumsq, f_x_mean, f_sum_x2, beta_ir, x;
+  float *an_x=p_work->an_x, *ptr_x;
+
+  *pf_heart_rate=-999.0;
+  *ratio=0.0;
+  p_work->n_size=0; // The workspace no longer describes a complete batch
+  n_max_lag=n_size/2;
+  if(n_max_lag>HIGHEST_PERIOD) n_max_lag=HIGHEST_PERIOD;
+  if(n_size>RFA_BUFFER_SIZE || n_max_lag<LOWEST_PERIOD+2) return 0;
+
+  f_ir_mean=0.0;
+  for (k=0; k<n_size; ++k) f_ir_mean += pun_ir_buffer[k];
+  f_ir_mean=f_ir_mean/n_size;
+  if(f_ir_mean<min_ir_dc) return 0; // No finger
+  for (k=0,ptr_x=an_x; k<n_size; ++k,++ptr_x) *ptr_x = pun_ir_buffer[k] - f_ir_mean;
+
+  f_x_mean=(float)(n_size-1)/2.0;
+  f_sum_x2=(float)n_size*((float)n_size*n_size-1.0)/12.0;
+  beta_ir = rf_linear_regression_beta(an_x, f_x_mean, f_sum_x2);
+  for(k=0,x=-f_x_mean,ptr_x=an_x; k<n_size; ++k,++x,++ptr_x) *ptr_x -= beta_ir*x;
+  rf_rms(an_x, n_size, &f_ir_sumsq);
+  if(f_ir_sumsq<=0.0) return 0;
+
+  n_lag=LOWEST_PERIOD;
+  rf_initialize_periodicity_search(an_x, n_size, &n_lag, n_max_lag, min_autocorrelation_ratio, f_ir_sumsq);
+  if(n_lag==0) return 0;
+  rf_signal_periodicity(an_x, n_size, &n_lag, LOWEST_PERIOD, n_max_lag, min_autocorrelation_ratio, f_ir_sumsq, ratio);
+  if(n_lag==0) return 0;
+  *pf_heart_rate=FS60/rf_interpolate_peak_lag(an_x, n_size, n_lag, (*ratio)*f_ir_sumsq);
+  return 1;
+}
+
+uint8_t rf_prescreen(uint32_t *pun_ir_buffer, uint32_t *pun_red_buffer, int32_t n_size)
+/**
+* \brief        Cheap quality screen of a raw batch
+* \par          Details
+*               Two integer passes over the raw sensor counts. The first collects IR min/max, DC levels and
+*               the number of saturated samples. The second counts crossings of the IR baseline, a line through
+*               the means of the two halves of the batch, with a hysteresis of screen_hysteresis times the
+*               IR span. A pulse between MIN_HR and MAX_HR must cross it a bounded number of times.
+* \retval       RF_SCREEN_OK, or the reason the batch should be rejected
+*/
+{
+  int32_t k, n_half, n_crossings, n_min_crossings, n_max_crossings;
+  int8_t ch_side;
+  uint32_t un_ir_min, un_ir_max, un_saturated, un_ir_dc, un_red_dc;
+  uint64_t ul_ir_sum_1, ul_ir_sum_2, ul_red_sum;
+  float f_base, f_slope, f_hyst;
+
+  if(n_size<2) return RF_SCREEN_FLAT;
+  n_half=n_size/2;
+  un_ir_min=un_ir_max=pun_ir_buffer[0];
+  un_saturated=0;
+  ul_ir_sum_1=ul_ir_sum_2=ul_red_sum=0;
+  for(k=0; k<n_size; ++k) {
+    if(pun_ir_buffer[k]<un_ir_min) un_ir_min=pun_ir_buffer[k];
+    if(pun_ir_buffer[k]>un_ir_max) un_ir_max=pun_ir_buffer[k];
+    if(pun_ir_buffer[k]>=ADC_CEILING || pun_red_buffer[k]>=ADC_CEILING) un_saturated++;
+    if(k<n_half) ul_ir_sum_1+=pun_ir_buffer[k];
+    else ul_ir_sum_2+=pun_ir_buffer[k];
+    ul_red_sum+=pun_red_buffer[k];
+  }
+  un_ir_dc=(uint32_t)((ul_ir_sum_1+ul_ir_sum_2)/n_size);
+  un_red_dc=(uint32_t)(ul_red_sum/n_size);
+  if(un_ir_dc<min_ir_dc || un_red_dc<min_red_dc) return RF_SCREEN_FINGER_OFF;
+  if(un_saturated>max_saturated_fraction*n_size) return RF_SCREEN_SATURATED;
+  if(un_ir_max-un_ir_min<min_ir_span) return RF_SCREEN_FLAT;
+
+  // Baseline through the half means, evaluated at sample k as f_base+f_slope*k
+  f_slope=((float)ul_ir_sum_2/(n_size-n_half)-(float)ul_ir_sum_1/n_half)/(n_size/2.0);
+  f_base=(float)ul_ir_sum_1/n_half-f_slope*(n_half-1)/2.0;
+  f_hyst=(un_ir_max-un_ir_min)*screen_hysteresis;
+  n_crossings=0;
+  ch_side=0;
+  for(k=0; k<n_size; ++k,f_base+=f_slope) {
+    if(pun_ir_buffer[k]>f_base+f_hyst) {
+      if(ch_side<0) n_crossings++;
+      ch_side=1;
+    } else if(pun_ir_buffer[k]<f_base-f_hyst) {
+      if(ch_side>0) n_crossings++;
+      ch_side=-1;
+    }
+  }
+  // Two crossings per beat. Allow one partial beat at the low end and twice the maximal rate at the high end.
+  n_min_crossings=2*(MIN_HR*n_size/FS60)-1;
+  n_max_crossings=4*(MAX_HR*n_size/FS60)+2;
+  if(n_crossings<n_min_crossings || n_crossings>n_max_crossings) return RF_SCREEN_APERIODIC;
+  return RF_SCREEN_OK;
+}
+
+float rf_rejection_rate(rf_state_t *p_state)
+/**
+* \brief        Pre-screen rejection rate
+* \par          Details
+*               Fraction of the batches processed with *p_state that rf_prescreen() rejected.
+* \retval       Rejection rate between 0 and 1
+*/
+{
+  if(p_state->un_batches==0) return 0.0;
+  return (float)p_state->un_rejected/p_state->un_batches;
+}
+
+void rf_track_hit(rf_state_t *p_state, float f_lag)
+/**
+* \brief        Update the heart rate tracker with a valid batch
+* \par          Details
+*               Locks the tracker on the first valid batch. Afterwards an alpha-beta filter blends the measured
+*               peak lag into the tracked lag and its rate of change. The search band follows the residual:
+*               a good prediction narrows it down to track_band_min, a surprise widens it.
+* \retval       None
+*/
+{
+  float f_predicted, f_residual;
+  if(p_state->f_track_lag<=0.0) {
+    p_state->f_track_lag=f_lag;
+    p_state->f_track_rate=0.0;
+    p_state->f_track_band=track_band_init;
+    p_state->uch_track_age=0;
+  } else {
+    f_predicted=p_state->f_track_lag+p_state->f_track_rate;
+    f_residual=f_lag-f_predicted;
+    p_state->f_track_lag=f_predicted+track_alpha*f_residual;
+    p_state->f_track_rate+=track_beta*f_residual;
+    p_state->f_track_band=0.5*p_state->f_track_band+2.0*fabs(f_residual);
+    if(p_state->f_track_band<track_band_min) p_state->f_track_band=track_band_min;
+  }
+  p_state->uch_track_misses=0;
+}
+
+void rf_track_miss(rf_state_t *p_state)
+/**
+* \brief        Update the heart rate tracker with an invalid batch
+* \par          Details
+*               Resets the reported peak interval. A locked tracker holds its prediction and doubles the search
+*               band, so an isolated bad batch does not cost the full initial scan. After TRACK_MAX_MISSES invalid
+*               batches in a row the lock is dropped and the next valid batch starts from scratch.
+* \retval       None
+*/
+{
+  p_state->n_last_peak_interval=LOWEST_PERIOD;
+  p_state->f_last_peak_interval=LOWEST_PERIOD;
+  p_state->f_heart_rate=-999.0;
+  if(p_state->f_track_lag<=0.0) return;
+  if(++p_state->uch_track_misses>=TRACK_MAX_MISSES) {
+    p_state->f_track_lag=0.0; // Lost the pulse
+    p_state->uch_track_misses=0;
+    return;
+  }
+  p_state->f_track_rate=0.0;
+  p_state->f_track_band*=2.0;
+  if(p_state->f_track_band>(HIGHEST_PERIOD-LOWEST_PERIOD)/2) p_state->f_track_band=(HIGHEST_PERIOD-LOWEST_PERIOD)/2;
+}
+
 float rf_linear_regression_beta(float *pn_x, float xmean, float sum_x2)
 /**
 * \brief        Coefficient beta of linear regression 
 * \par          Details
 *               Compute directional coefficient, beta, of a linear regression of pn_x against mean-centered
-*               point index values (0 to RFA_BUFFER_SIZE-1). xmean must equal to (RFA_BUFFER_SIZE-1)/2! sum_x2 is 
+*               point index values (0 to n-1, n being the batch length). xmean must equal to (n-1)/2! sum_x2 is 
 *               the sum of squares of the mean-centered index values. 
 *               Robert Fraczkiewicz, 12/22/2017
 * \retval       Beta
@@ -162,6 +527,27 @@ float rf_autocorrelation(float *pn_x, int32_t n_size, int32_t n_lag)
   return sum/n_temp;
 }
 
+float rf_interpolate_peak_lag(float *pn_x, int32_t n_size, int32_t n_lag, float aut_peak)
+/**
+* \brief        Sub-sample position of an autocorrelation peak
+* \par          Details
+*               Fits a parabola through the autocorrelation at n_lag-1, n_lag and n_lag+1 and returns
+*               the lag of its vertex. aut_peak is the already known autocorrelation at n_lag. If n_lag
+*               is not a local maximum, it is returned unchanged. The correction never exceeds half a lag.
+* \retval       Fractional lag of the peak
+*/
+{
+  float aut_left,aut_right,denom,delta;
+  aut_left=rf_autocorrelation(pn_x, n_size, n_lag-1);
+  aut_right=rf_autocorrelation(pn_x, n_size, n_lag+1);
+  denom=aut_left-2.0*aut_peak+aut_right;
+  if(denom>=0.0) return (float)n_lag; // Not a local maximum, nothing to refine
+  delta=0.5*(aut_left-aut_right)/denom;
+  if(delta>0.5) delta=0.5;
+  else if(delta<-0.5) delta=-0.5;
+  return n_lag+delta;
+}
+
 void rf_initialize_periodicity_search(float *pn_x, int32_t n_size, int32_t *p_last_periodicity, int32_t n_max_distance, float min_aut_ratio, float aut_lag0)
 /**
 * \brief        Search the range of true signal periodicity
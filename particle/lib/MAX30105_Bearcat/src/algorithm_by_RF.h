@@ -42,12 +42,13 @@
  * and/or sample length would require these paramteres to be adjusted.
  */
  // HN changed FS to 50Hz
-#define ST 4      // Sampling time in s. WARNING: if you change ST, then you MUST recalcuate the sum_X2 parameter below!
+#define ST 4      // Sampling time in s. Sets the largest batch, RFA_BUFFER_SIZE. Shorter batches may be passed at run time.
 #define FS 50     // Sampling frequency in Hz. WARNING: if you change FS, then you MUST recalcuate the sum_X2 parameter below!
 // Sum of squares of ST*FS numbers from -mean_X (see below) to +mean_X incremented be one. For example, given ST=4 and FS=50,
 // the sum consists of 200 terms: (-99.5)^2 + (-98.5)^2 + (-97.5)^2 + ... + (97.5)^2 + (98.5)^2 + (99.5)^2
 // The sum is symmetrc, so you can evaluate it by multiplying its positive half by 2. It is precalcuated here for enhanced 
-// performance.
+// performance. The estimator itself derives this sum from the actual batch length, so that batches shorter than
+// RFA_BUFFER_SIZE (e.g. 2 s windows) are detrended correctly.
 const float sum_X2 = 666650.0; // WARNING: you MUST recalculate this sum if you changed either ST or FS above!
 // WARNING: The two parameters below are CRUCIAL! Proper HR evaluation depends on these.
 #define MAX_HR 180  // Maximal heart rate. To eliminate erroneous signals, calculated HR should never be greater than this number.
@@ -58,6 +59,33 @@ const float min_autocorrelation_ratio = 0.5;
 // Pearson correlation between red and IR signals.
 // Good quality signals must have their correlation coefficient greater than this minimum.
 const float min_pearson_correlation = 0.8;
+// Pre-screen limits, applied to the raw sensor counts before any floating point work.
+const uint32_t ADC_CEILING = 0x3FFFF; // Largest 18-bit sample the MAX30102 can report
+const uint32_t min_ir_dc = 50000;     // Lower IR DC level means no finger on the sensor
+const uint32_t min_red_dc = 1;        // Lower red DC level means the red LED is off or disconnected
+const uint32_t min_ir_span = 20;      // Smaller IR peak-to-peak span cannot carry a pulse
+const float max_saturated_fraction = 0.05; // Fraction of samples allowed to sit at ADC_CEILING
+const float screen_hysteresis = 0.125;     // Mean-crossing hysteresis, as a fraction of the IR span
+// Heart rate tracker. Once locked on a valid batch, an alpha-beta filter predicts the next peak lag and the
+// periodicity search is confined to a band around that prediction. Invalid batches widen the band instead of
+// forcing the full initial scan, until TRACK_MAX_MISSES of them in a row drop the lock.
+#define TRACK_MAX_MISSES 3        // Consecutive invalid batches tolerated while locked
+const float track_alpha = 0.5;    // Weight of the measured lag in the tracked lag
+const float track_beta = 0.1;     // Weight of the lag residual in the tracked lag rate
+const float track_band_min = 2.0; // Narrowest half-width of the search band, in lags
+const float track_band_init = 4.0; // Half-width of the band right after locking
+const float track_band_warm = 8.0; // Half-width of the band after rf_warm_start(), the pulse may have moved since
+// A band search cannot leave a harmonic or sub-harmonic of the pulse it locked on by mistake. Every
+// TRACK_RESEARCH_BATCHES locked batches, and whenever the band search ends below track_research_ratio, the full
+// initial scan runs as well. If it finds the first autocorrelation peak outside the band, the tracker locks on it.
+#define TRACK_RESEARCH_BATCHES 8     // Locked batches between full periodicity searches
+const float track_research_ratio = 0.65; // Autocorrelation ratio below which a locked batch is searched in full
+// Adaptive window. rf_adaptive_window_r() starts with a short batch and asks for more samples while the result is
+// marginal, up to RFA_BUFFER_SIZE. A result is marginal unless it is valid and both its Pearson correlation and its
+// autocorrelation ratio clear the minima above by these margins.
+#define MIN_ST 2                              // Shortest batch in s
+const float window_pearson_margin = 0.1;      // Required excess over min_pearson_correlation
+const float window_autocorrelation_margin = 0.1; // Required excess over min_autocorrelation_ratio
 
 /*
  * Derived parameters 
@@ -68,12 +96,75 @@ const int32_t RFA_BUFFER_SIZE = FS*ST; // Number of smaples in a single batch
 const int32_t FS60 = FS*60;  // Conversion factor for heart rate from bps to bpm
 const int32_t LOWEST_PERIOD = FS60/MAX_HR; // Minimal distance between peaks
 const int32_t HIGHEST_PERIOD = FS60/MIN_HR; // Maximal distance between peaks
+const int32_t RF_MIN_WINDOW = FS*MIN_ST; // Number of samples in the shortest adaptive batch
+const int32_t RF_WINDOW_STEP = FS; // Samples added to a marginal adaptive batch
 const float mean_X = (float)(RFA_BUFFER_SIZE-1)/2.0; // Mean value of the set of integers from 0 to RFA_BUFFER_SIZE-1. For ST=4 and FS=50 it's equal to 99.5.
 
+/*
+ * Pre-screen reason codes, as returned by rf_prescreen()
+ */
+#define RF_SCREEN_OK         0 // Batch is worth running through the estimator
+#define RF_SCREEN_FINGER_OFF 1 // IR or red DC level too low
+#define RF_SCREEN_SATURATED  2 // Too many samples at ADC_CEILING
+#define RF_SCREEN_FLAT       3 // IR span too small
+#define RF_SCREEN_APERIODIC  4 // Baseline crossings inconsistent with MIN_HR..MAX_HR
+
+/*
+ * Estimator state
+ * Everything the estimator carries over from one batch to the next. Give each channel, device
+ * or recorded session its own instance and initialize it with rf_init_state() before the first call.
+ */
+typedef struct {
+  int32_t n_last_peak_interval; // Lag of the last autocorrelation peak. LOWEST_PERIOD forces a fresh periodicity search.
+  float f_last_peak_interval;   // The same lag refined to a fraction of a sample
+  float f_heart_rate;           // Heart rate from the fractional lag, -999 if the last batch was invalid
+  uint8_t uch_last_screen;      // Pre-screen result of the last batch, one of RF_SCREEN_*
+  uint32_t un_batches;          // Number of batches processed
+  uint32_t un_rejected;         // Number of batches rejected by the pre-screen
+  float f_track_lag;            // Tracked peak lag, 0 while the tracker is not locked
+  float f_track_rate;           // Tracked change of the peak lag per batch
+  float f_track_band;           // Half-width of the search band around the predicted lag
+  uint8_t uch_track_misses;     // Invalid batches in a row since the last valid one
+  uint8_t uch_track_age;        // Locked batches since the last full periodicity search
+} rf_state_t;
+
+/*
+ * Workspace
+ * Scratch memory for the detrended IR and red signals of one batch. Nothing in it is carried into the
+ * next call, so a single workspace can be reused by every estimator running on the same thread. Keep it
+ * out of small thread stacks: make it static or global. RF_WORKSPACE_SIZE is the number of bytes required.
+ * Until the next call, it also holds the intermediates of the last batch, so that further metrics (see
+ * algorithm_metrics.h) need only an incremental pass over the already detrended signals.
+ */
+typedef struct {
+  float an_x[RFA_BUFFER_SIZE]; // ir, DC and linear trend removed
+  float an_y[RFA_BUFFER_SIZE]; // red, DC and linear trend removed
+  int32_t n_size;     // Length of the batch described below, 0 if it was rejected before detrending
+  float f_ir_dc;      // DC means of the raw signals
+  float f_red_dc;
+  float f_ir_beta;    // Slopes of the removed linear trends, in counts per sample
+  float f_red_beta;
+  float f_ir_ac;      // RMS of the detrended signals
+  float f_red_ac;
+} rf_workspace_t;
+const size_t RF_WORKSPACE_SIZE = sizeof(rf_workspace_t);
+
+void rf_init_state(rf_state_t *p_state);
+int8_t rf_warm_start(rf_state_t *p_state, float f_lag);
+void rf_heart_rate_and_oxygen_saturation_r(rf_state_t *p_state, rf_workspace_t *p_work, uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, float *pn_spo2, 
+                                        int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid, float *ratio, float *correl);
 void rf_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, float *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, 
                                         int8_t *pch_hr_valid, float *ratio, float *correl);
+int8_t rf_adaptive_window_r(rf_state_t *p_state, rf_workspace_t *p_work, uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, float *pn_spo2, 
+                                        int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid, float *ratio, float *correl);
+int8_t rf_provisional_heart_rate(rf_workspace_t *p_work, uint32_t *pun_ir_buffer, int32_t n_size, float *pf_heart_rate, float *ratio);
+uint8_t rf_prescreen(uint32_t *pun_ir_buffer, uint32_t *pun_red_buffer, int32_t n_size);
+float rf_rejection_rate(rf_state_t *p_state);
+void rf_track_hit(rf_state_t *p_state, float f_lag);
+void rf_track_miss(rf_state_t *p_state);
 float rf_linear_regression_beta(float *pn_x, float xmean, float sum_x2);
 float rf_autocorrelation(float *pn_x, int32_t n_size, int32_t n_lag);
+float rf_interpolate_peak_lag(float *pn_x, int32_t n_size, int32_t n_lag, float aut_peak);
 float rf_rms(float *pn_x, int32_t n_size, float *sumsq);
 float rf_Pcorrelation(float *pn_x, float *pn_y, int32_t n_size);
 void rf_initialize_periodicity_search(float *pn_x, int32_t n_size, int32_t *p_last_periodicity, int32_t n_max_distance, float min_aut_ratio, float aut_lag0);
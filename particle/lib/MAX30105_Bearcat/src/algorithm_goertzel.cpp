@@ -0,0 +1,176 @@
+/*
+ * Goertzel filter-bank heart rate estimator, see algorithm_goertzel.h
+ */
+#include "algorithm_goertzel.h"
+#include <math.h>
+
+static void gz_clear_batch(gz_state_t *p_state)
+/**
+* \brief        Start a new batch
+* \par          Details
+*               Zeroes the resonators and the per-batch sums. Running DC estimates are kept.
+* \retval       None
+*/
+{
+  int32_t k;
+  for (k=0; k<GZ_BINS; ++k) {
+    p_state->af_s1[k]=0.0;
+    p_state->af_s2[k]=0.0;
+  }
+  p_state->f_ir_sum=0.0;
+  p_state->f_red_sum=0.0;
+  p_state->f_ir_sumsq=0.0;
+  p_state->f_red_sumsq=0.0;
+  p_state->n_samples=0;
+}
+
+void gz_init(gz_state_t *p_state)
+/**
+* \brief        Initialize estimator state
+* \par          Details
+*               Computes the resonator coefficients and clears all history.
+*
+* \param[out]   *p_state                 - Estimator state to initialize
+*
+* \retval       None
+*/
+{
+  int32_t k;
+  for (k=0; k<GZ_BINS; ++k)
+    p_state->af_coeff[k]=2.0*cos(2.0*M_PI*(MIN_HR+k*GZ_BPM_STEP)/FS60);
+  p_state->f_ir_dc=0.0;
+  p_state->f_red_dc=0.0;
+  p_state->b_primed=false;
+  gz_clear_batch(p_state);
+}
+
+void gz_push(gz_state_t *p_state, uint32_t un_ir, uint32_t un_red)
+/**
+* \brief        Feed one sample pair into the bank
+* \par          Details
+*               Removes the running DC estimate and advances every resonator by one sample.
+*
+* \param[in,out] *p_state                - Estimator state, see gz_init()
+* \param[in]    un_ir                   - Raw IR sample
+* \param[in]    un_red                  - Raw red sample
+*
+* \retval       None
+*/
+{
+  int32_t k;
+  float x, y, s0;
+  float *pf_coeff=p_state->af_coeff, *pf_s1=p_state->af_s1, *pf_s2=p_state->af_s2;
+
+  if (!p_state->b_primed) {
+    p_state->f_ir_dc=un_ir;
+    p_state->f_red_dc=un_red;
+    p_state->b_primed=true;
+  }
+  p_state->f_ir_dc+=gz_dc_alpha*(un_ir-p_state->f_ir_dc);
+  p_state->f_red_dc+=gz_dc_alpha*(un_red-p_state->f_red_dc);
+  x=un_ir-p_state->f_ir_dc;
+  y=un_red-p_state->f_red_dc;
+
+  p_state->f_ir_sum+=un_ir;
+  p_state->f_red_sum+=un_red;
+  p_state->f_ir_sumsq+=x*x;
+  p_state->f_red_sumsq+=y*y;
+  p_state->n_samples++;
+
+  for (k=0; k<GZ_BINS; ++k) {
+    s0=x+pf_coeff[k]*pf_s1[k]-pf_s2[k];
+    pf_s2[k]=pf_s1[k];
+    pf_s1[k]=s0;
+  }
+}
+
+void gz_heart_rate_and_oxygen_saturation(gz_state_t *p_state, float *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, 
+                int8_t *pch_hr_valid, float *pf_heart_rate, float *pf_purity)
+/**
+* \brief        Calculate the heart rate and SpO2 level of the batch pushed so far
+* \par          Details
+*               Picks the strong resonator with the most power at itself plus its second harmonic
+*               and interpolates the peak between its neighbours.
+*               The heart rate is valid if the main lobes of the peak and of its second harmonic,
+*               each one DFT bin of the batch length wide on either side, hold at least
+*               min_spectral_purity of the bank's power and the peak is not at the edge of the bank.
+*               Starts a new batch on return.
+*
+* \param[in,out] *p_state                - Estimator state
+* \param[out]    *pn_spo2                - Calculated SpO2 value
+* \param[out]    *pch_spo2_valid         - 1 if the calculated SpO2 value is valid
+* \param[out]    *pn_heart_rate          - Calculated heart rate value, rounded
+* \param[out]    *pch_hr_valid           - 1 if the calculated heart rate value is valid
+* \param[out]    *pf_heart_rate          - Calculated heart rate value, fractional
+* \param[out]    *pf_purity              - Spectral purity between 0 and 1
+*
+* \retval       None
+*/
+{
+  int32_t k, n_peak, n_lobe, n_harmonic;
+  float af_power[GZ_BINS];
+  float f_total, f_max, f_lobe, f_delta, f_denom, f_score, f_best, xy_ratio;
+
+  *pn_heart_rate = -999;
+  *pch_hr_valid = 0;
+  *pf_heart_rate = -999.0;
+  *pf_purity = 0.0;
+  *pn_spo2 = -999;
+  *pch_spo2_valid = 0;
+  if (p_state->n_samples<2) {
+    gz_clear_batch(p_state);
+    return;
+  }
+
+  // Power of each resonator
+  f_total=0.0;
+  f_max=0.0;
+  for (k=0; k<GZ_BINS; ++k) {
+    af_power[k]=p_state->af_s1[k]*p_state->af_s1[k]+p_state->af_s2[k]*p_state->af_s2[k]
+               -p_state->af_coeff[k]*p_state->af_s1[k]*p_state->af_s2[k];
+    f_total+=af_power[k];
+    if (af_power[k]>f_max) f_max=af_power[k];
+  }
+
+  // Pulse frequency: among the resonators with at least half the strongest one's power, the one with
+  // the most power at itself plus its second harmonic. Summing the harmonic keeps a strong harmonic
+  // from being taken for the pulse at low heart rates; the power floor keeps leakage below a fast
+  // pulse from being taken for its subharmonic.
+  n_peak=0;
+  f_best=0.0;
+  for (k=0; k<GZ_BINS; ++k) {
+    if (af_power[k]<0.5*f_max) continue;
+    n_harmonic=k+(MIN_HR+k*GZ_BPM_STEP)/GZ_BPM_STEP;
+    f_score=af_power[k]+(n_harmonic<GZ_BINS ? af_power[n_harmonic] : 0.0);
+    if (f_score>f_best) {
+      f_best=f_score;
+      n_peak=k;
+    }
+  }
+
+  // Share of power in the main lobe, one DFT bin (FS60/n bpm) on either side of the peak, and in the
+  // main lobe of its second harmonic, where a PPG pulse puts much of its power at low heart rates
+  n_lobe=(int32_t)ceil((float)FS60/(p_state->n_samples*GZ_BPM_STEP));
+  n_harmonic=n_peak+(MIN_HR+n_peak*GZ_BPM_STEP)/GZ_BPM_STEP;
+  f_lobe=0.0;
+  for (k=0; k<GZ_BINS; ++k)
+    if ((k>=n_peak-n_lobe && k<=n_peak+n_lobe) || (k>=n_harmonic-n_lobe && k<=n_harmonic+n_lobe)) f_lobe+=af_power[k];
+  *pf_purity = f_total>0.0 ? f_lobe/f_total : 0.0;
+
+  if (n_peak>0 && n_peak<GZ_BINS-1 && *pf_purity>=min_spectral_purity) {
+    f_delta=0.0;
+    f_denom=af_power[n_peak-1]-2.0*af_power[n_peak]+af_power[n_peak+1];
+    if (f_denom<0.0) f_delta=0.5*(af_power[n_peak-1]-af_power[n_peak+1])/f_denom;
+    *pf_heart_rate = MIN_HR+(n_peak+f_delta)*GZ_BPM_STEP;
+    *pn_heart_rate = (int32_t)(*pf_heart_rate+0.5);
+    *pch_hr_valid = 1;
+
+    // Same calibration as rf_heart_rate_and_oxygen_saturation_r(), from the RMS of the high-passed signals
+    xy_ratio=(sqrt(p_state->f_red_sumsq)*p_state->f_ir_sum)/(sqrt(p_state->f_ir_sumsq)*p_state->f_red_sum);
+    if (xy_ratio>0.02 && xy_ratio<1.84) {
+      *pn_spo2 = (-45.060*xy_ratio + 30.354)*xy_ratio + 94.845;
+      *pch_spo2_valid = 1;
+    }
+  }
+  gz_clear_batch(p_state);
+}
@@ -0,0 +1,48 @@
+/*
+ * Goertzel filter-bank heart rate estimator.
+ *
+ * A low-cost alternative to the autocorrelation search of algorithm_by_RF. A bank of Goertzel
+ * resonators, one every GZ_BPM_STEP bpm from MIN_HR to MAX_HR, is updated as each sample arrives.
+ * When a batch is complete, the strongest resonator, refined by parabolic interpolation, gives the
+ * pulse frequency. The share of the bank's power within the main lobes of that frequency and its
+ * second harmonic, the spectral purity, tells a clean pulse from noise. SpO2 comes from the RMS of the high-passed red and IR
+ * signals with the same calibration as the RF estimator.
+ *
+ * Cost is one multiply and two adds per resonator and sample, with no work left for the end of
+ * the batch beyond a single pass over the bank.
+ */
+#ifndef ALGORITHM_GOERTZEL_H_
+#define ALGORITHM_GOERTZEL_H_
+#include <Arduino.h>
+#include "algorithm_by_RF.h"
+
+#define GZ_BPM_STEP 4 // Spacing of the resonators in bpm
+const int32_t GZ_BINS = (MAX_HR-MIN_HR)/GZ_BPM_STEP+1; // Number of resonators
+// Good quality signals must have at least this share of the bank's power in the main lobes of the peak and its harmonic.
+const float min_spectral_purity = 0.6;
+// Weight of a new sample in the running DC estimate that is removed before the bank, about 0.25 Hz at FS=50.
+const float gz_dc_alpha = 1.0/32.0;
+
+/*
+ * Estimator state for one IR/red sample stream
+ */
+typedef struct {
+  float af_coeff[GZ_BINS]; // 2*cos(2*pi*f/FS) of each resonator
+  float af_s1[GZ_BINS];    // Resonator outputs one sample back
+  float af_s2[GZ_BINS];    // Resonator outputs two samples back
+  float f_ir_dc;           // Running DC estimates, carried across batches
+  float f_red_dc;
+  float f_ir_sum;          // Sums of raw samples in the current batch
+  float f_red_sum;
+  float f_ir_sumsq;        // Sums of squares of the high-passed samples in the current batch
+  float f_red_sumsq;
+  int32_t n_samples;       // Samples in the current batch
+  bool b_primed;           // false until the DC estimates have been seeded
+} gz_state_t;
+
+void gz_init(gz_state_t *p_state);
+void gz_push(gz_state_t *p_state, uint32_t un_ir, uint32_t un_red);
+void gz_heart_rate_and_oxygen_saturation(gz_state_t *p_state, float *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, 
+                                        int8_t *pch_hr_valid, float *pf_heart_rate, float *pf_purity);
+
+#endif /* ALGORITHM_GOERTZEL_H_ */
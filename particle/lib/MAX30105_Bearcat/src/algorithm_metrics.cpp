@@ -0,0 +1,225 @@
+/*
+ * Derived metrics: perfusion index, RR interval variability and respiratory rate.
+ * See algorithm_metrics.h.
+ */
+#include "algorithm_metrics.h"
+#include <math.h>
+
+void dm_init(dm_state_t *p_state)
+/**
+* \brief        Initialize metrics state
+* \par          Details
+*               Starts a new session: forgets all beats and RR intervals.
+*
+* \param[out]   *p_state                 - Metrics state to initialize
+*
+* \retval       None
+*/
+{
+  p_state->f_perfusion_index=-999.0;
+  p_state->f_rmssd=-999.0;
+  p_state->f_sdnn=-999.0;
+  p_state->f_respiratory_rate=-999.0;
+  p_state->f_time=0.0;
+  p_state->f_last_beat=-1.0;
+  p_state->f_last_rr=0.0;
+  p_state->un_rr=0;
+  p_state->f_rr_sum=0.0;
+  p_state->f_rr_sumsq=0.0;
+  p_state->un_rr_diffs=0;
+  p_state->f_rr_diff_sumsq=0.0;
+  p_state->uch_beats=0;
+  p_state->uch_head=0;
+}
+
+static void dm_add_beat(dm_state_t *p_state, float f_time, float f_baseline, float f_period)
+/**
+* \brief        Record one beat
+* \par          Details
+*               Adds the beat to the respiratory history and, if it follows the previous beat by a plausible
+*               interval, the interval to the RR statistics. A beat too close to the previous one is the tail of
+*               that beat and is ignored. A gap too long breaks the chain of successive differences.
+* \retval       None
+*/
+{
+  float f_rr, f_diff;
+  if(p_state->f_last_beat>=0.0) {
+    f_rr=f_time-p_state->f_last_beat;
+    if(f_rr<min_rr_fraction*f_period) return;
+    if(f_rr<=max_rr_fraction*f_period) {
+      p_state->un_rr++;
+      p_state->f_rr_sum+=f_rr;
+      p_state->f_rr_sumsq+=f_rr*f_rr;
+      if(p_state->f_last_rr>0.0) {
+        f_diff=f_rr-p_state->f_last_rr;
+        p_state->un_rr_diffs++;
+        p_state->f_rr_diff_sumsq+=f_diff*f_diff;
+      }
+      p_state->f_last_rr=f_rr;
+    } else p_state->f_last_rr=0.0;
+  }
+  p_state->f_last_beat=f_time;
+  p_state->af_beat_time[p_state->uch_head]=f_time;
+  p_state->af_beat_baseline[p_state->uch_head]=f_baseline;
+  p_state->uch_head=(p_state->uch_head+1)%DM_MAX_BEATS;
+  if(p_state->uch_beats<DM_MAX_BEATS) p_state->uch_beats++;
+}
+
+int8_t dm_update(dm_state_t *p_state, rf_state_t *p_rf_state, rf_workspace_t *p_work, int32_t n_batch_length, int8_t ch_hr_valid)
+/**
+* \brief        Update the metrics with the batch just processed by the RF estimator
+* \par          Details
+*               Call right after rf_heart_rate_and_oxygen_saturation_r() or a final rf_adaptive_window_r(),
+*               before anything else uses the workspace, and for every batch of the session so that beat times
+*               stay continuous. A single pass over the detrended IR signal finds its peak-to-peak span and
+*               the beats: local maxima above the RMS level, of which only the highest within min_rr_fraction
+*               of the RF period is kept. Beat times are refined by parabolic interpolation. The raw IR level
+*               at each beat, rebuilt from the DC level, the removed trend and the detrended signal, is where
+*               respiration shows.
+*               An invalid batch only advances the session time and breaks the chain of beats.
+*
+* \param[in,out] *p_state                - Metrics state, see dm_init()
+* \param[in]    *p_rf_state              - RF estimator state after the batch
+* \param[in]    *p_work                  - RF workspace after the batch
+* \param[in]    n_batch_length           - Number of samples in the batch
+* \param[in]    ch_hr_valid              - 1 if the RF estimator found a valid heart rate
+*
+* \retval       1 if the batch contributed to the metrics
+*/
+{
+  int32_t k, n_size, n_min_gap, n_cand;
+  float f_period, f_time, f_max, f_min, f_left, f_right, f_denom, f_delta, f_mean_rr;
+  float *an_x=p_work->an_x;
+
+  f_time=p_state->f_time;
+  p_state->f_time+=(float)n_batch_length/FS;
+  n_size=p_work->n_size;
+  f_period=p_rf_state->f_last_peak_interval;
+  if(!ch_hr_valid || n_size!=n_batch_length || n_size<3 || f_period<=0.0) {
+    p_state->f_last_beat=-1.0;
+    p_state->f_last_rr=0.0;
+    return 0;
+  }
+
+  // Single pass: span of the pulse, and the highest local maximum per beat
+  n_min_gap=(int32_t)(min_rr_fraction*f_period);
+  n_cand=-1;
+  f_max=f_min=an_x[0];
+  for(k=1; k<n_size-1; ++k) {
+    if(an_x[k]>f_max) f_max=an_x[k];
+    if(an_x[k]<f_min) f_min=an_x[k];
+    if(an_x[k]<=p_work->f_ir_ac || an_x[k]<=an_x[k-1] || an_x[k]<an_x[k+1]) continue;
+    if(n_cand>=0 && k-n_cand<n_min_gap) {
+      if(an_x[k]>an_x[n_cand]) n_cand=k; // Same beat, higher maximum
+      continue;
+    }
+    if(n_cand>=0) {
+      f_left=an_x[n_cand-1];
+      f_right=an_x[n_cand+1];
+      f_denom=f_left-2.0*an_x[n_cand]+f_right;
+      f_delta=f_denom<0.0 ? 0.5*(f_left-f_right)/f_denom : 0.0;
+      dm_add_beat(p_state, f_time+(n_cand+f_delta)/FS,
+                  p_work->f_ir_dc+p_work->f_ir_beta*(n_cand-(n_size-1)/2.0)+an_x[n_cand], f_period/FS);
+    }
+    n_cand=k;
+  }
+  if(an_x[n_size-1]>f_max) f_max=an_x[n_size-1];
+  if(an_x[n_size-1]<f_min) f_min=an_x[n_size-1];
+  // The last candidate is a beat too. A dicrotic wave at the start of the next batch falls within
+  // min_rr_fraction of it and is ignored.
+  if(n_cand>=0) {
+    f_left=an_x[n_cand-1];
+    f_right=an_x[n_cand+1];
+    f_denom=f_left-2.0*an_x[n_cand]+f_right;
+    f_delta=f_denom<0.0 ? 0.5*(f_left-f_right)/f_denom : 0.0;
+    dm_add_beat(p_state, f_time+(n_cand+f_delta)/FS,
+                p_work->f_ir_dc+p_work->f_ir_beta*(n_cand-(n_size-1)/2.0)+an_x[n_cand], f_period/FS);
+  }
+
+  p_state->f_perfusion_index=100.0*(f_max-f_min)/p_work->f_ir_dc;
+  if(p_state->un_rr>=2) {
+    f_mean_rr=p_state->f_rr_sum/p_state->un_rr;
+    p_state->f_sdnn=1000.0*sqrt(fabs(p_state->f_rr_sumsq/p_state->un_rr-f_mean_rr*f_mean_rr));
+  }
+  if(p_state->un_rr_diffs>=1)
+    p_state->f_rmssd=1000.0*sqrt(p_state->f_rr_diff_sumsq/p_state->un_rr_diffs);
+  p_state->f_respiratory_rate=dm_respiratory_rate(p_state);
+  return 1;
+}
+
+float dm_respiratory_rate(dm_state_t *p_state)
+/**
+* \brief        Respiratory rate from the beat-to-beat IR level
+* \par          Details
+*               Removes the linear trend from the IR level of the beats in the history and detects its
+*               crossings of zero, with a hysteresis of 1/4 of its RMS. A breath is the interval between two
+*               consecutive crossings in the same direction. The median interval is used, so that the gap left
+*               by a batch without beats costs one long interval rather than a biased rate.
+* \retval       Breaths per minute, -999 if the history is too short or the rate is out of range
+*/
+{
+  int32_t k, j, n_beats, n_first, n_idx, n_intervals, n_dir;
+  int8_t ch_side, ch_new;
+  float f_t_mean, f_b_mean, f_stt, f_stb, f_slope, f_sumsq, f_hyst, f_span, f_r, f_t, f_interval, f_median;
+  float af_last_crossing[2];           // Last rising and falling crossing, negative if none yet
+  float af_breath[DM_MAX_BEATS];       // Intervals between crossings in the same direction
+
+  n_beats=p_state->uch_beats;
+  if(n_beats<DM_MIN_BEATS) return -999.0;
+  n_first=(p_state->uch_head+DM_MAX_BEATS-n_beats)%DM_MAX_BEATS;
+  f_span=p_state->af_beat_time[(n_first+n_beats-1)%DM_MAX_BEATS]-p_state->af_beat_time[n_first];
+  if(f_span<min_respiration_span) return -999.0;
+
+  f_t_mean=f_b_mean=0.0;
+  for(k=0; k<n_beats; ++k) {
+    n_idx=(n_first+k)%DM_MAX_BEATS;
+    f_t_mean+=p_state->af_beat_time[n_idx];
+    f_b_mean+=p_state->af_beat_baseline[n_idx];
+  }
+  f_t_mean/=n_beats;
+  f_b_mean/=n_beats;
+  f_stt=f_stb=0.0;
+  for(k=0; k<n_beats; ++k) {
+    n_idx=(n_first+k)%DM_MAX_BEATS;
+    f_stt+=(p_state->af_beat_time[n_idx]-f_t_mean)*(p_state->af_beat_time[n_idx]-f_t_mean);
+    f_stb+=(p_state->af_beat_time[n_idx]-f_t_mean)*(p_state->af_beat_baseline[n_idx]-f_b_mean);
+  }
+  f_slope=f_stt>0.0 ? f_stb/f_stt : 0.0;
+  f_sumsq=0.0;
+  for(k=0; k<n_beats; ++k) {
+    n_idx=(n_first+k)%DM_MAX_BEATS;
+    f_r=p_state->af_beat_baseline[n_idx]-f_b_mean-f_slope*(p_state->af_beat_time[n_idx]-f_t_mean);
+    f_sumsq+=f_r*f_r;
+  }
+  f_hyst=0.25*sqrt(f_sumsq/n_beats);
+  if(f_hyst<=0.0) return -999.0;
+
+  // Breath intervals, kept sorted by insertion
+  n_intervals=0;
+  ch_side=0;
+  af_last_crossing[0]=af_last_crossing[1]=-1.0;
+  for(k=0; k<n_beats; ++k) {
+    n_idx=(n_first+k)%DM_MAX_BEATS;
+    f_t=p_state->af_beat_time[n_idx];
+    f_r=p_state->af_beat_baseline[n_idx]-f_b_mean-f_slope*(f_t-f_t_mean);
+    if(f_r>f_hyst) ch_new=1;
+    else if(f_r<-f_hyst) ch_new=-1;
+    else continue;
+    if(ch_side!=0 && ch_new!=ch_side) {
+      n_dir=ch_new>0 ? 0 : 1;
+      if(af_last_crossing[n_dir]>=0.0) {
+        f_interval=f_t-af_last_crossing[n_dir];
+        for(j=n_intervals; j>0 && af_breath[j-1]>f_interval; --j) af_breath[j]=af_breath[j-1];
+        af_breath[j]=f_interval;
+        n_intervals++;
+      }
+      af_last_crossing[n_dir]=f_t;
+    }
+    ch_side=ch_new;
+  }
+  if(n_intervals<2) return -999.0;
+  f_median=(n_intervals&1) ? af_breath[n_intervals/2] : 0.5*(af_breath[n_intervals/2-1]+af_breath[n_intervals/2]);
+  f_r=60.0/f_median;
+  if(f_r<MIN_RESP_RATE || f_r>MAX_RESP_RATE) return -999.0;
+  return f_r;
+}
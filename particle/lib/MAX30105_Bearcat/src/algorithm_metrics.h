@@ -0,0 +1,55 @@
+/*
+ * Derived metrics: perfusion index, RR interval variability and respiratory rate.
+ *
+ * Computed on the device from what the RF estimator leaves in its workspace after a batch (see
+ * rf_workspace_t): the DC levels, the removed linear trends and the detrended IR signal. Each batch
+ * costs a single pass over the detrended IR signal, which finds the beats and their peak-to-peak
+ * span. Beats are stitched across consecutive batches, so that RR intervals and respiration build
+ * up over a measurement session.
+ *
+ * Respiratory rate follows the respiration-induced intensity variation: breathing modulates the IR
+ * level, which is sampled at each beat, and its oscillations are counted over the last DM_MAX_BEATS
+ * beats.
+ */
+#ifndef ALGORITHM_METRICS_H_
+#define ALGORITHM_METRICS_H_
+#include <Arduino.h>
+#include "algorithm_by_RF.h"
+
+#define DM_MAX_BEATS 32  // Beats kept for the respiratory rate estimate
+#define DM_MIN_BEATS 8   // Fewer beats do not give a respiratory rate
+// Accepted RR intervals lie between these fractions of the period found by the RF estimator. The lower
+// one also keeps the dicrotic wave from counting as a beat.
+const float min_rr_fraction = 0.7;
+const float max_rr_fraction = 1.4;
+const float min_respiration_span = 10.0; // Shortest beat history for a respiratory rate, in s
+#define MIN_RESP_RATE 4   // Respiratory rates outside these limits, in breaths per minute, are invalid
+#define MAX_RESP_RATE 40
+
+/*
+ * Metrics state for one measurement session
+ */
+typedef struct {
+  float f_perfusion_index;   // IR peak-to-peak over DC in percent, of the last valid batch
+  float f_rmssd;             // RMS of successive RR interval differences in ms, -999 until available
+  float f_sdnn;              // Standard deviation of RR intervals in ms, -999 until available
+  float f_respiratory_rate;  // Breaths per minute, -999 until available
+  float f_time;              // Session time at the start of the next batch, in s
+  float f_last_beat;         // Session time of the last beat, negative if the chain of beats is broken
+  float f_last_rr;           // Last RR interval in s, 0 if none
+  uint32_t un_rr;            // Number of RR intervals
+  float f_rr_sum;            // Sum and sum of squares of RR intervals in s
+  float f_rr_sumsq;
+  uint32_t un_rr_diffs;      // Number of successive RR differences
+  float f_rr_diff_sumsq;     // Sum of squared successive RR differences in s^2
+  float af_beat_time[DM_MAX_BEATS];     // Session time of recent beats, circular
+  float af_beat_baseline[DM_MAX_BEATS]; // Raw IR level at recent beats, circular
+  uint8_t uch_beats;         // Beats in the circular history
+  uint8_t uch_head;          // Next slot of the circular history
+} dm_state_t;
+
+void dm_init(dm_state_t *p_state);
+int8_t dm_update(dm_state_t *p_state, rf_state_t *p_rf_state, rf_workspace_t *p_work, int32_t n_batch_length, int8_t ch_hr_valid);
+float dm_respiratory_rate(dm_state_t *p_state);
+
+#endif /* ALGORITHM_METRICS_H_ */
@@ -0,0 +1,94 @@
+/*
+ * Multi-stage half-band decimation filter, see decimator.h
+ */
+#include "decimator.h"
+
+// Non-zero half of the symmetric half-band filter, Q15, Kaiser window with beta = 4. The center tap is
+// exactly 1/2 and the side taps sum to 1/2, so the gain is 1 at DC and 1/2 at FS/4:
+// -132, 0, 766, 0, -2495, 0, 10053, 16384, 10053, 0, -2495, 0, 766, 0, -132
+static const int32_t dec_side_coeffs[4] = {-132, 766, -2495, 10053}; // Taps 0, 2, 4, 6 and their mirrors
+static const int32_t dec_center_coeff = 16384;                        // Tap 7
+
+void dec_init(dec_state_t *p_state, uint8_t uch_stages)
+/**
+* \brief        Initialize decimator
+* \par          Details
+*               Clears the filter history and sets the number of half-band stages. The next
+*               dec_push() fills every history with its sample, so the first outputs start at
+*               the signal level instead of ramping up from zero.
+*
+* \param[out]   *p_state                 - Decimator state
+* \param[in]    uch_stages              - Number of stages, decimation factor is 2^uch_stages
+*
+* \retval       None
+*/
+{
+  memset(p_state, 0, sizeof(dec_state_t));
+  p_state->uch_stages = uch_stages > DEC_MAX_STAGES ? DEC_MAX_STAGES : uch_stages;
+}
+
+static int32_t dec_filter(const int32_t *pn_x)
+/**
+* \brief        Half-band filter output
+* \par          Details
+*               Evaluates the filter over the DEC_TAPS contiguous samples starting at pn_x,
+*               adding mirrored samples before multiplying. The result is rounded back from Q15.
+* \retval       Filtered sample
+*/
+{
+  int64_t acc;
+  acc  = (int64_t)dec_side_coeffs[0]*(pn_x[0]+pn_x[14]);
+  acc += (int64_t)dec_side_coeffs[1]*(pn_x[2]+pn_x[12]);
+  acc += (int64_t)dec_side_coeffs[2]*(pn_x[4]+pn_x[10]);
+  acc += (int64_t)dec_side_coeffs[3]*(pn_x[6]+pn_x[8]);
+  acc += (int64_t)dec_center_coeff*pn_x[7];
+  return (int32_t)((acc + (1 << 14)) >> 15);
+}
+
+int8_t dec_push(dec_state_t *p_state, uint32_t un_ir, uint32_t un_red, uint32_t *pun_ir, uint32_t *pun_red)
+/**
+* \brief        Feed one sample pair into the decimator
+* \par          Details
+*               Runs the pair through the stages. A stage passes a sample on to the next one only
+*               every second input, so an output appears once per 2^stages inputs.
+*
+* \param[in,out] *p_state                - Decimator state, see dec_init()
+* \param[in]    un_ir                   - Raw IR sample
+* \param[in]    un_red                  - Raw red sample
+* \param[out]   *pun_ir                  - Decimated IR sample, written only when 1 is returned
+* \param[out]   *pun_red                 - Decimated red sample, written only when 1 is returned
+*
+* \retval       1 if a decimated sample pair was produced, 0 otherwise
+*/
+{
+  uint8_t s, pos, k;
+  int32_t n_ir = (int32_t)un_ir, n_red = (int32_t)un_red;
+
+  if (!p_state->uch_primed) {
+    // A constant input passes every stage unchanged, so all stages start from the first sample
+    for (s = 0; s < p_state->uch_stages; s++) {
+      for (k = 0; k < 2*DEC_TAPS; k++) {
+        p_state->an_history[s][0][k] = n_ir;
+        p_state->an_history[s][1][k] = n_red;
+      }
+    }
+    p_state->uch_primed = 1;
+  }
+
+  for (s = 0; s < p_state->uch_stages; s++) {
+    pos = p_state->uch_pos[s];
+    p_state->an_history[s][0][pos] = p_state->an_history[s][0][pos+DEC_TAPS] = n_ir;
+    p_state->an_history[s][1][pos] = p_state->an_history[s][1][pos+DEC_TAPS] = n_red;
+    p_state->uch_pos[s] = (pos+1 == DEC_TAPS) ? 0 : pos+1;
+
+    p_state->uch_phase[s] ^= 1;
+    if (p_state->uch_phase[s]) return 0; // Dropped sample, nothing to compute
+
+    // The DEC_TAPS most recent samples, oldest first, start right after the newest one
+    n_ir = dec_filter(&p_state->an_history[s][0][pos+1]);
+    n_red = dec_filter(&p_state->an_history[s][1][pos+1]);
+  }
+  *pun_ir = n_ir < 0 ? 0 : (uint32_t)n_ir;
+  *pun_red = n_red < 0 ? 0 : (uint32_t)n_red;
+  return 1;
+}
@@ -0,0 +1,37 @@
+/*
+ * Multi-stage decimation filter between the MAX30102 FIFO and the DSP window.
+ *
+ * Each stage is a 15-tap half-band FIR that halves the sampling rate. Only
+ * every second output is computed, and the half-band zeros and the symmetry
+ * of the filter leave 5 multiplications per output and channel. A cascade
+ * of N stages decimates by 2^N, e.g. 200 Hz raw sensor samples to FS = 50 Hz
+ * with N = 2. Arithmetic is integer only: Q15 coefficients with unity DC
+ * gain, so DC levels used for SpO2 are preserved.
+ *
+ * Cost per input sample is bounded by 2 channels * 5 multiplications *
+ * (1/2 + 1/4 + ...) < 10 multiply-accumulates, whatever the number of stages.
+ */
+#ifndef DECIMATOR_H_
+#define DECIMATOR_H_
+#include <Arduino.h>
+
+#define DEC_MAX_STAGES 4 // Largest decimation factor is 2^DEC_MAX_STAGES
+#define DEC_TAPS 15      // Length of the half-band filter of each stage
+
+/*
+ * Decimator state for one IR/red sample stream
+ */
+typedef struct {
+  // Sample history per stage and channel (0 = ir, 1 = red). Every sample is written twice, DEC_TAPS apart,
+  // so the last DEC_TAPS samples are always contiguous.
+  int32_t an_history[DEC_MAX_STAGES][2][2*DEC_TAPS];
+  uint8_t uch_pos[DEC_MAX_STAGES];   // Next write position in the history of each stage
+  uint8_t uch_phase[DEC_MAX_STAGES]; // 1 if the next sample of a stage produces an output
+  uint8_t uch_stages;                // Number of active stages, 0 passes samples through
+  uint8_t uch_primed;                // 1 once the histories hold the first sample after dec_init()
+} dec_state_t;
+
+void dec_init(dec_state_t *p_state, uint8_t uch_stages);
+int8_t dec_push(dec_state_t *p_state, uint32_t un_ir, uint32_t un_red, uint32_t *pun_ir, uint32_t *pun_red);
+
+#endif /* DECIMATOR_H_ */
@@ -57,31 +57,49 @@
 
 #include "heartRate.h"
 
-int16_t IR_AC_Max = 20;
-int16_t IR_AC_Min = -20;
+#include <string.h>
 
-int16_t IR_AC_Signal_Current = 0;
-int16_t IR_AC_Signal_Previous;
-int16_t IR_AC_Signal_min = 0;
-int16_t IR_AC_Signal_max = 0;
-int16_t IR_Average_Estimated;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-int16_t positiveEdge = 0;
-int16_t negativeEdge = 0;
-int32_t ir_avg_reg = 0;
+static const uint16_t FIRCoeffs[12] = {172, 321, 579, 927, 1360, 1858, 2390, 2916, 3391, 3768, 4012, 4096};
+static const uint8_t FIRHistory = 22; //Previous samples each output needs
+static const uint16_t FIRBlockSize = 64; //Samples filtered per pass of the block filter
+static const uint8_t DCFractionBits = 11; //Leaves headroom for 18-bit samples in 32 bits
 
-int16_t cbuf[32];
-uint8_t offset = 0;
+//  Detector behind the single-stream functions
+static BeatDetector defaultDetector;
 
-static const uint16_t FIRCoeffs[12] = {172, 321, 579, 927, 1360, 1858, 2390, 2916, 3391, 3768, 4012, 4096};
+BeatDetector::BeatDetector(void)
+{
+  reset();
+}
+
+void BeatDetector::reset(void)
+{
+  IR_AC_Max = 20;
+  IR_AC_Min = -20;
+
+  IR_AC_Signal_Current = 0;
+  IR_AC_Signal_Previous = 0;
+  IR_AC_Signal_min = 0;
+  IR_AC_Signal_max = 0;
+  IR_Average_Estimated = 0;
+
+  positiveEdge = 0;
+  negativeEdge = 0;
+  ir_avg_reg = 0;
+
+  memset(cbuf, 0, sizeof(cbuf));
+  offset = 0;
+}
 
 //  Heart Rate Monitor functions takes a sample value and the sample number
 //  Returns true if a beat is detected
 //  A running average of four samples is recommended for display on the screen.
-bool checkForBeat(int32_t sample)
+bool BeatDetector::checkForBeat(int32_t sample)
 {
-  bool beatDetected = false;
-
   //  Save current state
   IR_AC_Signal_Previous = IR_AC_Signal_Current;
   
@@ -90,8 +108,30 @@ bool checkForBeat(int32_t sample)
   //Serial.println(IR_AC_Signal_Current);
 
   //  Process next data sample
-  IR_Average_Estimated = averageDCEstimator(&ir_avg_reg, sample);
-  IR_AC_Signal_Current = lowPassFIRFilter(sample - IR_Average_Estimated);
+  IR_AC_Signal_Current = lowPassFIRFilter(removeDC(sample));
+
+  return(detectBeat());
+}
+
+//  Average DC Estimator at full sample resolution, see averageDCEstimator()
+//  Returns the sample minus the DC estimate, saturated to 16 bits
+int16_t BeatDetector::removeDC(int32_t sample)
+{
+  ir_avg_reg += (((sample << DCFractionBits) - ir_avg_reg) >> 4);
+  IR_Average_Estimated = ir_avg_reg >> DCFractionBits;
+
+  int32_t ac = sample - IR_Average_Estimated;
+  if (ac > 32767) ac = 32767;
+  if (ac < -32768) ac = -32768;
+  return(ac);
+}
+
+//  Beat detection on the filtered signal, IR_AC_Signal_Current and
+//  IR_AC_Signal_Previous
+//  Returns true if a beat is detected
+bool BeatDetector::detectBeat(void)
+{
+  bool beatDetected = false;
 
   //  Detect positive zero crossing (rising edge)
   if ((IR_AC_Signal_Previous < 0) & (IR_AC_Signal_Current >= 0))
@@ -105,7 +145,7 @@ bool checkForBeat(int32_t sample)
     IR_AC_Signal_max = 0;
 
     //if ((IR_AC_Max - IR_AC_Min) > 100 & (IR_AC_Max - IR_AC_Min) < 1000)
-    if ((IR_AC_Max - IR_AC_Min) > 20 & (IR_AC_Max - IR_AC_Min) < 1000)
+    if ((IR_AC_Max - IR_AC_Min) > 20 && (IR_AC_Max - IR_AC_Min) < 1000)
     {
       //Heart beat!!!
       beatDetected = true;
@@ -135,29 +175,146 @@ bool checkForBeat(int32_t sample)
   return(beatDetected);
 }
 
-//  Average DC Estimator
-int16_t averageDCEstimator(int32_t *p, uint16_t x)
+//  Batch version of checkForBeat() over a span of samples
+//  Beat indices are relative to samples[0]; beats beyond maxBeats are counted
+//  but not stored. Filters with the block FIR filter, one block at a time.
+uint16_t BeatDetector::checkForBeats(const uint32_t *samples, uint16_t count, uint16_t *beats, uint16_t maxBeats)
 {
-  *p += ((((long) x << 15) - *p) >> 4);
-  return (*p >> 15);
+  int16_t ac[FIRBlockSize];
+  uint16_t numBeats = 0;
+
+  for (uint16_t done = 0 ; done < count ; done += FIRBlockSize)
+  {
+    uint16_t n = count - done < FIRBlockSize ? count - done : FIRBlockSize;
+
+    //  The DC estimator is recursive, so it stays per sample
+    for (uint16_t i = 0 ; i < n ; i++)
+    {
+      ac[i] = removeDC(samples[done + i]);
+    }
+    lowPassFIRFilter(ac, ac, n);
+
+    for (uint16_t i = 0 ; i < n ; i++)
+    {
+      IR_AC_Signal_Previous = IR_AC_Signal_Current;
+      IR_AC_Signal_Current = ac[i];
+      if (detectBeat())
+      {
+        if (numBeats < maxBeats) beats[numBeats] = done + i;
+        numBeats++;
+      }
+    }
+  }
+  return(numBeats);
 }
 
 //  Low Pass FIR Filter
-int16_t lowPassFIRFilter(int16_t din)
+int16_t BeatDetector::lowPassFIRFilter(int16_t din)
 {  
   cbuf[offset] = din;
 
-  int32_t z = mul16(FIRCoeffs[11], cbuf[(offset - 11) & 0x1F]);
+  //  Symmetric taps are added in 32 bits, so full-scale inputs do not wrap
+  int32_t z = (int32_t)FIRCoeffs[11] * cbuf[(offset - 11) & 0x1F];
   
   for (uint8_t i = 0 ; i < 11 ; i++)
   {
-    z += mul16(FIRCoeffs[i], cbuf[(offset - i) & 0x1F] + cbuf[(offset - 22 + i) & 0x1F]);
+    z += (int32_t)FIRCoeffs[i] * (cbuf[(offset - i) & 0x1F] + cbuf[(offset - 22 + i) & 0x1F]);
   }
 
   offset++;
   offset %= 32; //Wrap condition
 
-  return(z >> 15);
+  z >>= 15;
+  if (z > 32767) z = 32767;
+  if (z < -32768) z = -32768;
+  return(z);
+}
+
+//  Low Pass FIR Filter over a linear history
+//  x[0..count+FIRHistory) holds the FIRHistory previous samples followed by
+//  the count samples to filter. Same arithmetic as lowPassFIRFilter(int16_t).
+static void lowPassFIRBlock(const int16_t *x, int16_t *dout, uint16_t count)
+{
+  uint16_t k = 0;
+
+#if defined(__SSE2__)
+  //  8 outputs at a time; madd multiplies both samples of a symmetric pair
+  //  by their coefficient and adds them in 32 bits
+  for ( ; k + 8 <= count ; k += 8)
+  {
+    __m128i zLow = _mm_setzero_si128();
+    __m128i zHigh = _mm_setzero_si128();
+
+    for (uint8_t i = 0 ; i < 12 ; i++)
+    {
+      __m128i newer = _mm_loadu_si128((const __m128i *)&x[k + FIRHistory - i]);
+      __m128i older = i < 11 ? _mm_loadu_si128((const __m128i *)&x[k + i]) : _mm_setzero_si128();
+      __m128i coeffs = _mm_set1_epi32(((uint32_t)FIRCoeffs[i] << 16) | FIRCoeffs[i]);
+      zLow = _mm_add_epi32(zLow, _mm_madd_epi16(_mm_unpacklo_epi16(newer, older), coeffs));
+      zHigh = _mm_add_epi32(zHigh, _mm_madd_epi16(_mm_unpackhi_epi16(newer, older), coeffs));
+    }
+    _mm_storeu_si128((__m128i *)&dout[k], _mm_packs_epi32(_mm_srai_epi32(zLow, 15), _mm_srai_epi32(zHigh, 15)));
+  }
+#endif
+
+  for ( ; k < count ; k++)
+  {
+    int32_t z = (int32_t)FIRCoeffs[11] * x[k + 11];
+
+    for (uint8_t i = 0 ; i < 11 ; i++)
+    {
+      z += (int32_t)FIRCoeffs[i] * (x[k + FIRHistory - i] + x[k + i]);
+    }
+    z >>= 15;
+    if (z > 32767) z = 32767;
+    if (z < -32768) z = -32768;
+    dout[k] = z;
+  }
+}
+
+//  Block Low Pass FIR Filter
+void BeatDetector::lowPassFIRFilter(const int16_t *din, int16_t *dout, uint16_t count)
+{
+  int16_t x[FIRHistory + FIRBlockSize]; //Linear history followed by a block
+
+  //  The previous samples, oldest first
+  for (uint8_t i = 0 ; i < FIRHistory ; i++)
+  {
+    x[i] = cbuf[(offset - FIRHistory + i) & 0x1F];
+  }
+
+  for (uint16_t done = 0 ; done < count ; done += FIRBlockSize)
+  {
+    uint16_t n = count - done < FIRBlockSize ? count - done : FIRBlockSize;
+    memcpy(&x[FIRHistory], &din[done], n * sizeof(int16_t));
+    lowPassFIRBlock(x, &dout[done], n);
+    memmove(x, &x[n], FIRHistory * sizeof(int16_t));
+  }
+
+  //  Leave the delay line as the per-sample filter would
+  offset = (offset + count) % 32;
+  for (uint8_t i = 0 ; i < FIRHistory ; i++)
+  {
+    cbuf[(offset - FIRHistory + i) & 0x1F] = x[i];
+  }
+}
+
+bool checkForBeat(int32_t sample)
+{
+  return(defaultDetector.checkForBeat(sample));
+}
+
+//  Average DC Estimator
+int16_t averageDCEstimator(int32_t *p, uint16_t x)
+{
+  *p += ((((long) x << 15) - *p) >> 4);
+  return (*p >> 15);
+}
+
+//  Low Pass FIR Filter
+int16_t lowPassFIRFilter(int16_t din)
+{
+  return(defaultDetector.lowPassFIRFilter(din));
 }
 
 //  Integer multiplier
@@ -61,6 +61,51 @@
  #include "WProgram.h"
 #endif
 
+//  Beat detector for one stream of IR samples. Every instance keeps its own
+//  state, so several streams (channels, recorded sessions, threads) can be
+//  processed at once. Not thread safe per instance.
+//  Samples are taken at full resolution (the MAX3010x delivers 18 bits); the
+//  AC part of the signal saturates at 16 bits instead of wrapping.
+class BeatDetector {
+ public:
+  BeatDetector(void);
+
+  void reset(void); //Back to the power-on state
+
+  bool checkForBeat(int32_t sample); //Returns true if a beat is detected
+  //Runs checkForBeat() over count samples, stores the indices of up to maxBeats
+  //beats in beats[] and returns the number of beats detected
+  uint16_t checkForBeats(const uint32_t *samples, uint16_t count, uint16_t *beats, uint16_t maxBeats);
+
+  int16_t lowPassFIRFilter(int16_t din); //Output saturates at 16 bits
+  //Filters count samples at once, with the results of count calls of
+  //lowPassFIRFilter(int16_t). din and dout may be the same array.
+  void lowPassFIRFilter(const int16_t *din, int16_t *dout, uint16_t count);
+
+ private:
+  int16_t removeDC(int32_t sample); //Returns the AC part of a sample
+  bool detectBeat(void); //Edge logic on the filtered signal
+
+  int16_t IR_AC_Max;
+  int16_t IR_AC_Min;
+
+  int16_t IR_AC_Signal_Current;
+  int16_t IR_AC_Signal_Previous;
+  int16_t IR_AC_Signal_min;
+  int16_t IR_AC_Signal_max;
+  int32_t IR_Average_Estimated;
+
+  int16_t positiveEdge;
+  int16_t negativeEdge;
+  int32_t ir_avg_reg; //DC estimate with DCFractionBits fraction bits
+
+  int16_t cbuf[32];
+  uint8_t offset;
+};
+
+//  Single-stream functions, kept for existing sketches. checkForBeat() and
+//  lowPassFIRFilter() share one BeatDetector. averageDCEstimator() and mul16()
+//  keep their 16-bit behavior.
 bool checkForBeat(int32_t sample);
 int16_t averageDCEstimator(int32_t *p, uint16_t x);
 int16_t lowPassFIRFilter(int16_t din);
@@ -60,101 +60,165 @@
 #include "Arduino.h"
 #include "spo2_algorithm.h"
 
-#if defined(ARDUINO_AVR_UNO)
-//Arduino Uno doesn't have enough SRAM to store 100 samples of IR led data and red led data in 32-bit format
-//To solve this problem, 16-bit MSB of the sampled data will be truncated.  Samples become 16-bit data.
-void maxim_heart_rate_and_oxygen_saturation(uint16_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint16_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, 
-                int32_t *pn_heart_rate, int8_t *pch_hr_valid)
-#else
-void maxim_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, 
-                int32_t *pn_heart_rate, int8_t *pch_hr_valid)
+#if defined(__SSE2__)
+#include <emmintrin.h>
 #endif
+
+//uch_spo2_table is approximated as  -45.060*ratioAverage* ratioAverage + 30.354 *ratioAverage + 94.845 ;
+static const uint8_t uch_spo2_table[184]={ 95, 95, 95, 96, 96, 96, 97, 97, 97, 97, 97, 98, 98, 98, 98, 98, 99, 99, 99, 99, 
+              99, 99, 99, 99, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 
+              100, 100, 100, 100, 99, 99, 99, 99, 99, 99, 99, 99, 98, 98, 98, 98, 98, 98, 97, 97, 
+              97, 97, 96, 96, 96, 96, 95, 95, 95, 94, 94, 94, 93, 93, 93, 92, 92, 92, 91, 91, 
+              90, 90, 89, 89, 89, 88, 88, 87, 87, 86, 86, 85, 85, 84, 84, 83, 82, 82, 81, 81, 
+              80, 80, 79, 78, 78, 77, 76, 76, 75, 74, 74, 73, 72, 72, 71, 70, 69, 69, 68, 67, 
+              66, 66, 65, 64, 63, 62, 62, 61, 60, 59, 58, 57, 56, 56, 55, 54, 53, 52, 51, 50, 
+              49, 48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33, 31, 30, 29, 
+              28, 27, 26, 25, 23, 22, 21, 20, 19, 17, 16, 15, 14, 12, 11, 10, 9, 7, 6, 5, 
+              3, 2, 1 } ;
+
+// Workspace used by the non-reentrant entry point, maxim_heart_rate_and_oxygen_saturation()
+static maxim_workspace_t maxim_default_workspace;
+
+void maxim_heart_rate_and_oxygen_saturation(maxim_sample_t *pun_ir_buffer, int32_t n_ir_buffer_length, maxim_sample_t *pun_red_buffer, int32_t *pn_spo2, 
+                int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid)
 /**
-* \brief        Calculate the heart rate and SpO2 level
+* \brief        Calculate the heart rate and SpO2 level at MAXIM_FS, using a single, shared workspace
 * \par          Details
-*               By detecting  peaks of PPG cycle and corresponding AC/DC of red/infra-red signal, the an_ratio for the SPO2 is computed.
-*               Since this algorithm is aiming for Arm M0/M3. formaula for SPO2 did not achieve the accuracy due to register overflow.
-*               Thus, accurate SPO2 is precalculated and save longo uch_spo2_table[] per each an_ratio.
-*
-* \param[in]    *pun_ir_buffer           - IR sensor data buffer
-* \param[in]    n_ir_buffer_length      - IR sensor data buffer length
-* \param[in]    *pun_red_buffer          - Red sensor data buffer
-* \param[out]    *pn_spo2                - Calculated SpO2 value
-* \param[out]    *pch_spo2_valid         - 1 if the calculated SpO2 value is valid
-* \param[out]    *pn_heart_rate          - Calculated heart rate value
-* \param[out]    *pch_hr_valid           - 1 if the calculated heart rate value is valid
+*               Kept for existing callers. Not reentrant. Use maxim_heart_rate_and_oxygen_saturation_r() instead.
 *
 * \retval       None
 */
 {
-  uint32_t un_ir_mean,un_only_once ;
-  int32_t k, n_i_ratio_count;
-  int32_t i, s, m, n_exact_ir_valley_locs_count, n_middle_idx;
-  int32_t n_th1, n_npks, n_c_min;   
-  int32_t an_ir_valley_locs[15] ;
-  int32_t n_peak_interval_sum;
-  
-  int32_t n_y_ac, n_x_ac;
-  int32_t n_spo2_calc; 
-  int32_t n_y_dc_max, n_x_dc_max; 
-  int32_t n_y_dc_max_idx, n_x_dc_max_idx; 
-  int32_t an_ratio[5], n_ratio_average; 
-  int32_t n_nume, n_denom ;
+  maxim_heart_rate_and_oxygen_saturation_r(&maxim_default_workspace, MAXIM_FS, pun_ir_buffer, n_ir_buffer_length, pun_red_buffer, 
+                pn_spo2, pch_spo2_valid, pn_heart_rate, pch_hr_valid);
+}
 
-  // calculates DC mean and subtract DC from ir
-  un_ir_mean =0; 
-  for (k=0 ; k<n_ir_buffer_length ; k++ ) un_ir_mean += pun_ir_buffer[k] ;
-  un_ir_mean =un_ir_mean/n_ir_buffer_length ;
-    
-  // remove DC and invert signal so that we can use peak detector as valley detector
-  for (k=0 ; k<n_ir_buffer_length ; k++ )  
-    an_x[k] = -1*(pun_ir_buffer[k] - un_ir_mean) ; 
-    
-  // 4 pt Moving Average
-  for(k=0; k< BUFFER_SIZE-MA4_SIZE; k++){
-    an_x[k]=( an_x[k]+an_x[k+1]+ an_x[k+2]+ an_x[k+3])/(int)4;        
+static uint32_t maxim_sum(maxim_sample_t *pun_x, int32_t n_size)
+/**
+* \brief        Sum samples
+* \par          Details
+*               Wraps around like the uint32_t sum it replaces. Uses SSE2 where available.
+*
+* \retval       The sum
+*/
+{
+  uint32_t un_sum=0;
+  int32_t k=0;
+
+#if defined(__SSE2__)
+  if (sizeof(maxim_sample_t)==4) {
+    __m128i v_sum=_mm_setzero_si128();
+    uint32_t aun_sum[4];
+    for ( ; k+4<=n_size; k+=4)
+      v_sum=_mm_add_epi32(v_sum, _mm_loadu_si128((const __m128i *)&pun_x[k]));
+    _mm_storeu_si128((__m128i *)aun_sum, v_sum);
+    un_sum=aun_sum[0]+aun_sum[1]+aun_sum[2]+aun_sum[3];
+  }
+#endif
+  for ( ; k<n_size; k++) un_sum += pun_x[k];
+  return un_sum;
+}
+
+static int32_t maxim_invert_and_average(int32_t *pn_x, maxim_sample_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t un_ir_mean)
+/**
+* \brief        Remove DC, invert and smooth the IR signal
+* \par          Details
+*               pn_x[k] = -(ir[k] - mean), then averaged over 4 points for k < n_ir_buffer_length-MAXIM_MA4_SIZE;
+*               the last MAXIM_MA4_SIZE samples are left unaveraged. One pass with a running sum over the 4 points,
+*               with SSE2 where available.
+*
+* \retval       The sum of pn_x[], from which the threshold is derived
+*/
+{
+  int32_t k=0, n_sum, n_th=0;
+  int32_t n_ma_size=n_ir_buffer_length-MAXIM_MA4_SIZE;
+
+#if defined(__SSE2__)
+  if (sizeof(maxim_sample_t)==4) {
+    // 4 outputs at a time from 4 overlapping loads, truncating the division toward zero like '/'
+    __m128i v_mean=_mm_set1_epi32((int32_t)un_ir_mean), v_th=_mm_setzero_si128(), v_sum, v_avg;
+    int32_t an_th[4];
+    for ( ; k+4<=n_ma_size; k+=4) {
+      v_sum=_mm_add_epi32(
+          _mm_add_epi32(_mm_sub_epi32(v_mean, _mm_loadu_si128((const __m128i *)&pun_ir_buffer[k])),
+                        _mm_sub_epi32(v_mean, _mm_loadu_si128((const __m128i *)&pun_ir_buffer[k+1]))),
+          _mm_add_epi32(_mm_sub_epi32(v_mean, _mm_loadu_si128((const __m128i *)&pun_ir_buffer[k+2])),
+                        _mm_sub_epi32(v_mean, _mm_loadu_si128((const __m128i *)&pun_ir_buffer[k+3]))));
+      v_avg=_mm_srai_epi32(_mm_add_epi32(v_sum, _mm_srli_epi32(_mm_srai_epi32(v_sum, 31), 30)), 2);
+      _mm_storeu_si128((__m128i *)&pn_x[k], v_avg);
+      v_th=_mm_add_epi32(v_th, v_avg);
+    }
+    _mm_storeu_si128((__m128i *)an_th, v_th);
+    n_th=an_th[0]+an_th[1]+an_th[2]+an_th[3];
   }
-  // calculate threshold  
-  n_th1=0; 
-  for ( k=0 ; k<BUFFER_SIZE ;k++){
-    n_th1 +=  an_x[k];
+#endif
+  if (k<n_ma_size) {
+    n_sum=0;
+    for (int32_t i=k; i<k+MAXIM_MA4_SIZE; i++) n_sum += (int32_t)(un_ir_mean-pun_ir_buffer[i]);
+    for ( ; k<n_ma_size; k++) {
+      pn_x[k]=n_sum/(int)4;
+      n_th += pn_x[k];
+      n_sum += (int32_t)(un_ir_mean-pun_ir_buffer[k+MAXIM_MA4_SIZE]) - (int32_t)(un_ir_mean-pun_ir_buffer[k]);
+    }
   }
-  n_th1=  n_th1/ ( BUFFER_SIZE);
-  if( n_th1<30) n_th1=30; // min allowed
-  if( n_th1>60) n_th1=60; // max allowed
+  for ( ; k<n_ir_buffer_length; k++) {
+    pn_x[k]=(int32_t)(un_ir_mean-pun_ir_buffer[k]);
+    n_th += pn_x[k];
+  }
+  return n_th;
+}
+
+static void maxim_heart_rate_from_valleys(int32_t n_fs, int32_t *pn_locs, int32_t n_npks, int32_t *pn_heart_rate, int8_t *pch_hr_valid)
+/**
+* \brief        Calculate the heart rate from the valley locations
+* \par          Details
+*               Uses the mean interval between the first and the last valley
+*
+* \retval       None
+*/
+{
+  int32_t k, n_peak_interval_sum;
 
-  for ( k=0 ; k<15;k++) an_ir_valley_locs[k]=0;
-  // since we flipped signal, we use peak detector as valley detector
-  maxim_find_peaks( an_ir_valley_locs, &n_npks, an_x, BUFFER_SIZE, n_th1, 4, 15 );//peak_height, peak_distance, max_num_peaks 
   n_peak_interval_sum =0;
   if (n_npks>=2){
-    for (k=1; k<n_npks; k++) n_peak_interval_sum += (an_ir_valley_locs[k] -an_ir_valley_locs[k -1] ) ;
+    for (k=1; k<n_npks; k++) n_peak_interval_sum += (pn_locs[k] -pn_locs[k -1] ) ;
     n_peak_interval_sum =n_peak_interval_sum/(n_npks-1);
-    *pn_heart_rate =(int32_t)( (FS*60)/ n_peak_interval_sum );
+    *pn_heart_rate =(int32_t)( (n_fs*60)/ n_peak_interval_sum );
     *pch_hr_valid  = 1;
   }
   else  { 
     *pn_heart_rate = -999; // unable to calculate because # of peaks are too small
     *pch_hr_valid  = 0;
   }
+}
 
-  //  load raw value again for SPO2 calculation : RED(=y) and IR(=X)
-  for (k=0 ; k<n_ir_buffer_length ; k++ )  {
-      an_x[k] =  pun_ir_buffer[k] ; 
-      an_y[k] =  pun_red_buffer[k] ; 
-  }
+static void maxim_oxygen_saturation_from_valleys(maxim_sample_t *pun_ir_buffer, int32_t n_ir_buffer_length, maxim_sample_t *pun_red_buffer, 
+                int32_t *pn_locs, int32_t n_npks, int32_t *pn_spo2, int8_t *pch_spo2_valid)
+/**
+* \brief        Calculate the SpO2 level from the valley locations
+* \par          Details
+*               Takes the median AC/DC ratio of red and IR over up to 5 beats, reading the raw samples directly
+*
+* \retval       None
+*/
+{
+  int32_t k, i, n_i_ratio_count, n_middle_idx;
+  int32_t n_y_ac, n_x_ac;
+  int32_t n_spo2_calc; 
+  int32_t n_y_dc_max, n_x_dc_max; 
+  int32_t n_y_dc_max_idx = 0, n_x_dc_max_idx = 0;
+  int32_t an_ratio[5], n_ratio_average; 
+  int32_t n_nume, n_denom ;
+  int32_t n_x, n_y;
 
-  // find precise min near an_ir_valley_locs
-  n_exact_ir_valley_locs_count =n_npks; 
-  
   //using exact_ir_valley_locs , find ir-red DC andir-red AC for SPO2 calibration an_ratio
-  //finding AC/DC maximum of raw
+  //finding AC/DC maximum of raw: RED(=y) and IR(=X)
 
   n_ratio_average =0; 
   n_i_ratio_count = 0; 
   for(k=0; k< 5; k++) an_ratio[k]=0;
-  for (k=0; k< n_exact_ir_valley_locs_count; k++){
-    if (an_ir_valley_locs[k] > BUFFER_SIZE ){
+  for (k=0; k< n_npks; k++){
+    if (pn_locs[k] > n_ir_buffer_length ){
       *pn_spo2 =  -999 ; // do not use SPO2 since valley loc is out of range
       *pch_spo2_valid  = 0; 
       return;
@@ -162,20 +226,23 @@ void maxim_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_i
   }
   // find max between two valley locations 
   // and use an_ratio betwen AC compoent of Ir & Red and DC compoent of Ir & Red for SPO2 
-  for (k=0; k< n_exact_ir_valley_locs_count-1; k++){
+  // valleys are ascending, so this sweeps the raw data once; it stops when no more ratios are kept
+  for (k=0; k< n_npks-1 && n_i_ratio_count <5; k++){
     n_y_dc_max= -16777216 ; 
     n_x_dc_max= -16777216; 
-    if (an_ir_valley_locs[k+1]-an_ir_valley_locs[k] >3){
-        for (i=an_ir_valley_locs[k]; i< an_ir_valley_locs[k+1]; i++){
-          if (an_x[i]> n_x_dc_max) {n_x_dc_max =an_x[i]; n_x_dc_max_idx=i;}
-          if (an_y[i]> n_y_dc_max) {n_y_dc_max =an_y[i]; n_y_dc_max_idx=i;}
+    if (pn_locs[k+1]-pn_locs[k] >3){
+        for (i=pn_locs[k]; i< pn_locs[k+1]; i++){
+          n_x = (int32_t)pun_ir_buffer[i];
+          n_y = (int32_t)pun_red_buffer[i];
+          if (n_x> n_x_dc_max) {n_x_dc_max =n_x; n_x_dc_max_idx=i;}
+          if (n_y> n_y_dc_max) {n_y_dc_max =n_y; n_y_dc_max_idx=i;}
       }
-      n_y_ac= (an_y[an_ir_valley_locs[k+1]] - an_y[an_ir_valley_locs[k] ] )*(n_y_dc_max_idx -an_ir_valley_locs[k]); //red
-      n_y_ac=  an_y[an_ir_valley_locs[k]] + n_y_ac/ (an_ir_valley_locs[k+1] - an_ir_valley_locs[k])  ; 
-      n_y_ac=  an_y[n_y_dc_max_idx] - n_y_ac;    // subracting linear DC compoenents from raw 
-      n_x_ac= (an_x[an_ir_valley_locs[k+1]] - an_x[an_ir_valley_locs[k] ] )*(n_x_dc_max_idx -an_ir_valley_locs[k]); // ir
-      n_x_ac=  an_x[an_ir_valley_locs[k]] + n_x_ac/ (an_ir_valley_locs[k+1] - an_ir_valley_locs[k]); 
-      n_x_ac=  an_x[n_y_dc_max_idx] - n_x_ac;      // subracting linear DC compoenents from raw 
+      n_y_ac= ((int32_t)pun_red_buffer[pn_locs[k+1]] - (int32_t)pun_red_buffer[pn_locs[k]] )*(n_y_dc_max_idx -pn_locs[k]); //red
+      n_y_ac=  (int32_t)pun_red_buffer[pn_locs[k]] + n_y_ac/ (pn_locs[k+1] - pn_locs[k])  ; 
+      n_y_ac=  (int32_t)pun_red_buffer[n_y_dc_max_idx] - n_y_ac;    // subracting linear DC compoenents from raw 
+      n_x_ac= ((int32_t)pun_ir_buffer[pn_locs[k+1]] - (int32_t)pun_ir_buffer[pn_locs[k]] )*(n_x_dc_max_idx -pn_locs[k]); // ir
+      n_x_ac=  (int32_t)pun_ir_buffer[pn_locs[k]] + n_x_ac/ (pn_locs[k+1] - pn_locs[k]); 
+      n_x_ac=  (int32_t)pun_ir_buffer[n_y_dc_max_idx] - n_x_ac;      // subracting linear DC compoenents from raw 
       n_nume=( n_y_ac *n_x_dc_max)>>7 ; //prepare X100 to preserve floating value
       n_denom= ( n_x_ac *n_y_dc_max)>>7;
       if (n_denom>0  && n_i_ratio_count <5 &&  n_nume != 0)
@@ -205,6 +272,213 @@ void maxim_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_i
   }
 }
 
+void maxim_heart_rate_and_oxygen_saturation_r(maxim_workspace_t *p_work, int32_t n_fs, maxim_sample_t *pun_ir_buffer, int32_t n_ir_buffer_length, 
+                maxim_sample_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid)
+/**
+* \brief        Calculate the heart rate and SpO2 level
+* \par          Details
+*               By detecting  peaks of PPG cycle and corresponding AC/DC of red/infra-red signal, the an_ratio for the SPO2 is computed.
+*               Since this algorithm is aiming for Arm M0/M3. formaula for SPO2 did not achieve the accuracy due to register overflow.
+*               Thus, accurate SPO2 is precalculated and save longo uch_spo2_table[] per each an_ratio.
+*               Intermediate signals are kept in *p_work, so concurrent callers need a workspace each. The minimal
+*               distance between valleys scales with n_fs; at MAXIM_FS the results are those of the original algorithm.
+*
+* \param[in]    *p_work                  - Workspace of MAXIM_WORKSPACE_SIZE bytes, contents are overwritten
+* \param[in]    n_fs                     - Sampling frequency in Hz, at most MAXIM_MAX_FS
+* \param[in]    *pun_ir_buffer           - IR sensor data buffer
+* \param[in]    n_ir_buffer_length      - IR sensor data buffer length, at most MAXIM_MAX_BUFFER_SIZE
+* \param[in]    *pun_red_buffer          - Red sensor data buffer
+* \param[out]    *pn_spo2                - Calculated SpO2 value
+* \param[out]    *pch_spo2_valid         - 1 if the calculated SpO2 value is valid
+* \param[out]    *pn_heart_rate          - Calculated heart rate value
+* \param[out]    *pch_hr_valid           - 1 if the calculated heart rate value is valid
+*
+* \retval       None
+*/
+{
+  uint32_t un_ir_mean;
+  int32_t k;
+  int32_t n_th1, n_npks;   
+  int32_t an_ir_valley_locs[MAXIM_MAX_PEAKS] ;
+  int32_t *an_x=p_work->an_x; //ir
+
+  if(n_fs<=0 || n_fs>MAXIM_MAX_FS || n_ir_buffer_length<=MAXIM_MA4_SIZE || n_ir_buffer_length>MAXIM_MAX_BUFFER_SIZE) {
+    *pn_heart_rate = -999; // batch does not fit into the workspace
+    *pch_hr_valid  = 0;
+    *pn_spo2 =  -999 ;
+    *pch_spo2_valid  = 0; 
+    return;
+  }
+
+  // calculates DC mean
+  un_ir_mean =maxim_sum(pun_ir_buffer, n_ir_buffer_length);
+  un_ir_mean =un_ir_mean/n_ir_buffer_length ;
+    
+  // remove DC, invert signal so that we can use peak detector as valley detector, 4 pt Moving Average
+  // and calculate threshold
+  n_th1=maxim_invert_and_average(an_x, pun_ir_buffer, n_ir_buffer_length, un_ir_mean);
+  n_th1=  n_th1/ ( n_ir_buffer_length);
+  if( n_th1<MAXIM_MIN_THRESHOLD) n_th1=MAXIM_MIN_THRESHOLD; // min allowed
+  if( n_th1>60) n_th1=60; // max allowed
+
+  for ( k=0 ; k<MAXIM_MAX_PEAKS;k++) an_ir_valley_locs[k]=0;
+  // since we flipped signal, we use peak detector as valley detector
+  maxim_find_peaks( an_ir_valley_locs, &n_npks, an_x, n_ir_buffer_length, n_th1, 4*n_fs/MAXIM_FS, MAXIM_MAX_PEAKS );//peak_height, peak_distance, max_num_peaks 
+  maxim_heart_rate_from_valleys(n_fs, an_ir_valley_locs, n_npks, pn_heart_rate, pch_hr_valid);
+  maxim_oxygen_saturation_from_valleys(pun_ir_buffer, n_ir_buffer_length, pun_red_buffer, an_ir_valley_locs, n_npks, 
+                pn_spo2, pch_spo2_valid);
+}
+
+void maxim_peak_detector_init(maxim_peak_detector_t *p_detector, int32_t n_fs)
+/**
+* \brief        Initialize a streaming valley detector
+* \par          Details
+*               Forgets the DC level and the depth of previous valleys, and starts a new batch
+*
+* \param[in]    n_fs                     - Sampling frequency in Hz, at most MAXIM_MAX_FS
+*
+* \retval       None
+*/
+{
+  int32_t k;
+
+  p_detector->n_fs=n_fs;
+  p_detector->n_refractory=4*n_fs/MAXIM_FS; // the minimal valley distance of the batch algorithm
+  // DC level over 2^n_dc_shift >= 2*n_fs samples, longer than a beat at the lowest heart rate
+  for (k=0; (1<<k) < 2*n_fs; k++);
+  p_detector->n_dc_shift=k;
+  p_detector->n_dc=0;
+  for (k=0; k<MAXIM_MA4_SIZE; k++) p_detector->an_ac[k]=0;
+  p_detector->n_samples=0;
+  p_detector->n_prev=0;
+  p_detector->n_envelope=0;
+  maxim_peak_detector_restart(p_detector);
+}
+
+void maxim_peak_detector_restart(maxim_peak_detector_t *p_detector)
+/**
+* \brief        Start a new batch
+* \par          Details
+*               Drops the valleys found so far and counts locations from the next sample. The DC level,
+*               the moving average and the threshold carry over, so valleys are found from the start
+*               of the batch.
+*
+* \retval       None
+*/
+{
+  p_detector->n_size=0;
+  p_detector->n_edge_loc=-1;
+  p_detector->n_npks=0;
+}
+
+static void maxim_peak_detector_valley(maxim_peak_detector_t *p_detector, int32_t n_loc, int32_t n_height)
+/**
+* \brief        Record a valley
+* \par          Details
+*               A valley within the refractory period of the previous one replaces it if it is deeper, like
+*               maxim_remove_close_peaks() keeps the largest of close peaks. Valleys feed the threshold envelope.
+*
+* \retval       None
+*/
+{
+  int32_t n_npks=p_detector->n_npks;
+
+  if (n_npks>0 && n_loc-p_detector->an_locs[n_npks-1] <= p_detector->n_refractory) {
+    if (n_height <= p_detector->n_last_height) return;
+    n_npks--;
+  }
+  else if (n_npks>=MAXIM_MAX_PEAKS) return;
+  p_detector->an_locs[n_npks]=n_loc;
+  p_detector->n_npks=n_npks+1;
+  p_detector->n_last_height=n_height;
+  // deepest recent valley, so that the shallower dicrotic wave stays below the threshold
+  if (n_height>p_detector->n_envelope) p_detector->n_envelope=n_height;
+  else p_detector->n_envelope += (n_height-p_detector->n_envelope)/4;
+}
+
+void maxim_peak_detector_push(maxim_peak_detector_t *p_detector, maxim_sample_t un_ir)
+/**
+* \brief        Process the next IR sample of the batch
+* \par          Details
+*               The sample is stored by the caller at index n_size of its batch buffer. Valleys are
+*               confirmed a few samples after they occur, once the signal rises again.
+*
+* \param[in]    un_ir                    - IR sample, below 2^27
+*
+* \retval       None
+*/
+{
+  int32_t k, n_x, n_loc, n_threshold;
+
+  // remove DC and invert signal so that we can use peak detector as valley detector
+  if (p_detector->n_dc==0) p_detector->n_dc=(int32_t)un_ir*16;
+  p_detector->n_dc += ((int32_t)un_ir*16-p_detector->n_dc) >> p_detector->n_dc_shift;
+  for (k=0; k<MAXIM_MA4_SIZE-1; k++) p_detector->an_ac[k]=p_detector->an_ac[k+1];
+  p_detector->an_ac[MAXIM_MA4_SIZE-1] = -((int32_t)un_ir*16-p_detector->n_dc)/16;
+  if (p_detector->n_samples<MAXIM_MA4_SIZE) p_detector->n_samples++;
+  n_loc=p_detector->n_size-(MAXIM_MA4_SIZE-1); // the 4 pt moving average ends here
+  p_detector->n_size++;
+  if (p_detector->n_samples<MAXIM_MA4_SIZE) return;
+
+  // 4 pt Moving Average
+  n_x=(p_detector->an_ac[0]+p_detector->an_ac[1]+p_detector->an_ac[2]+p_detector->an_ac[3])/(int)4;
+  // the threshold follows 70% of the depth of recent valleys, decaying over about 2.5 s without them
+  p_detector->n_envelope -= p_detector->n_envelope >> p_detector->n_dc_shift;
+  n_threshold=p_detector->n_envelope*7/10;
+  if (n_threshold<MAXIM_MIN_THRESHOLD) n_threshold=MAXIM_MIN_THRESHOLD;
+
+  if (p_detector->n_edge_loc>=0 && n_x<p_detector->n_edge_height) {
+    // right edge of a peak, for flat peaks the location is the left edge
+    maxim_peak_detector_valley(p_detector, p_detector->n_edge_loc, p_detector->n_edge_height);
+    p_detector->n_edge_loc=-1;
+  }
+  else if (n_x>p_detector->n_prev) {
+    // left edge of a potential peak
+    if (n_x>n_threshold && n_loc>=0) {
+      p_detector->n_edge_loc=n_loc;
+      p_detector->n_edge_height=n_x;
+    }
+    else
+      p_detector->n_edge_loc=-1;
+  }
+  p_detector->n_prev=n_x;
+}
+
+void maxim_heart_rate_and_oxygen_saturation_streamed(maxim_peak_detector_t *p_detector, maxim_sample_t *pun_ir_buffer, 
+                int32_t n_ir_buffer_length, maxim_sample_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, 
+                int32_t *pn_heart_rate, int8_t *pch_hr_valid)
+/**
+* \brief        Calculate the heart rate and SpO2 level of a batch from the valleys found while it was collected
+* \par          Details
+*               Every sample of the batch must have gone through maxim_peak_detector_push(). Only the SpO2 ratio
+*               stage is left to run, no workspace is needed. The detector is restarted for the next batch.
+*
+* \param[in]    *p_detector              - Detector the batch was pushed through
+* \param[in]    *pun_ir_buffer           - IR sensor data buffer
+* \param[in]    n_ir_buffer_length      - IR sensor data buffer length, the samples pushed
+* \param[in]    *pun_red_buffer          - Red sensor data buffer
+* \param[out]    *pn_spo2                - Calculated SpO2 value
+* \param[out]    *pch_spo2_valid         - 1 if the calculated SpO2 value is valid
+* \param[out]    *pn_heart_rate          - Calculated heart rate value
+* \param[out]    *pch_hr_valid           - 1 if the calculated heart rate value is valid
+*
+* \retval       None
+*/
+{
+  if (n_ir_buffer_length != p_detector->n_size) {
+    *pn_heart_rate = -999; // the valleys do not belong to this batch
+    *pch_hr_valid  = 0;
+    *pn_spo2 =  -999 ;
+    *pch_spo2_valid  = 0; 
+  }
+  else {
+    maxim_heart_rate_from_valleys(p_detector->n_fs, p_detector->an_locs, p_detector->n_npks, pn_heart_rate, pch_hr_valid);
+    maxim_oxygen_saturation_from_valleys(pun_ir_buffer, n_ir_buffer_length, pun_red_buffer, p_detector->an_locs, 
+                p_detector->n_npks, pn_spo2, pch_spo2_valid);
+  }
+  maxim_peak_detector_restart(p_detector);
+}
+
 
 void maxim_find_peaks( int32_t *pn_locs, int32_t *n_npks,  int32_t  *pn_x, int32_t n_size, int32_t n_min_height, int32_t n_min_distance, int32_t n_max_num )
 /**
@@ -217,7 +491,7 @@ void maxim_find_peaks( int32_t *pn_locs, int32_t *n_npks,  int32_t  *pn_x, int32
 {
   maxim_peaks_above_min_height( pn_locs, n_npks, pn_x, n_size, n_min_height );
   maxim_remove_close_peaks( pn_locs, n_npks, pn_x, n_min_distance );
-  *n_npks = min( *n_npks, n_max_num );
+  if (*n_npks > n_max_num) *n_npks = n_max_num;
 }
 
 void maxim_peaks_above_min_height( int32_t *pn_locs, int32_t *n_npks,  int32_t  *pn_x, int32_t n_size, int32_t n_min_height )
@@ -237,7 +511,7 @@ void maxim_peaks_above_min_height( int32_t *pn_locs, int32_t *n_npks,  int32_t
       n_width = 1;
       while (i+n_width < n_size && pn_x[i] == pn_x[i+n_width])  // find flat peaks
         n_width++;
-      if (pn_x[i] > pn_x[i+n_width] && (*n_npks) < 15 ){      // find right edge of peaks
+      if (pn_x[i] > pn_x[i+n_width] && (*n_npks) < MAXIM_MAX_PEAKS ){      // find right edge of peaks
         pn_locs[(*n_npks)++] = i;    
         // for flat peaks, peak location is left edge
         i += n_width+1;
@@ -279,16 +553,74 @@ void maxim_remove_close_peaks(int32_t *pn_locs, int32_t *pn_npks, int32_t *pn_x,
   maxim_sort_ascend( pn_locs, *pn_npks );
 }
 
+// Sorting networks for the arrays sorted per batch: up to 5 ratios and up to MAXIM_MAX_PEAKS valleys.
+// Each is a list of compare-exchange pairs (i, j) with i < j. An array shorter than a network is sorted
+// by the same network with every pair touching j >= n_size skipped: padding the array with elements
+// that sort last would leave those pairs without effect.
+static const uint8_t auch_sort_network_4[][2]={ {0,1},{2,3},{0,2},{1,3},{1,2} };
+static const uint8_t auch_sort_network_5[][2]={ {0,1},{3,4},{2,4},{2,3},{0,3},{0,2},{1,4},{1,3},{1,2} };
+static const uint8_t auch_sort_network_8[][2]={ {0,1},{2,3},{4,5},{6,7},{0,2},{1,3},{4,6},{5,7},{1,2},{5,6},
+              {0,4},{1,5},{2,6},{3,7},{2,4},{3,5},{1,2},{3,4},{5,6} };
+static const uint8_t auch_sort_network_16[][2]={ {0,1},{2,3},{4,5},{6,7},{8,9},{10,11},{12,13},{14,15},
+              {0,2},{1,3},{4,6},{5,7},{8,10},{9,11},{12,14},{13,15},{1,2},{5,6},{9,10},{13,14},
+              {0,4},{1,5},{2,6},{3,7},{8,12},{9,13},{10,14},{11,15},{2,4},{3,5},{10,12},{11,13},
+              {1,2},{3,4},{5,6},{9,10},{11,12},{13,14},{0,8},{1,9},{2,10},{3,11},{4,12},{5,13},
+              {6,14},{7,15},{4,8},{5,9},{6,10},{7,11},{2,4},{3,5},{6,8},{7,9},{10,12},{11,13},
+              {1,2},{3,4},{5,6},{7,8},{9,10},{11,12},{13,14} };
+
+static const uint8_t (*maxim_sort_network(int32_t n_size, int32_t *pn_pairs))[2]
+/**
+* \brief        Select a sorting network
+* \par          Details
+*               Picks the smallest network for n_size elements, 2 <= n_size <= MAXIM_MAX_SORT_SIZE
+*
+* \param[out]   *pn_pairs                - Number of compare-exchange pairs of the network
+*
+* \retval       The pairs of the network
+*/
+{
+  if (n_size<=4) {
+    *pn_pairs=sizeof(auch_sort_network_4)/sizeof(auch_sort_network_4[0]);
+    return auch_sort_network_4;
+  }
+  if (n_size==5) {
+    *pn_pairs=sizeof(auch_sort_network_5)/sizeof(auch_sort_network_5[0]);
+    return auch_sort_network_5;
+  }
+  if (n_size<=8) {
+    *pn_pairs=sizeof(auch_sort_network_8)/sizeof(auch_sort_network_8[0]);
+    return auch_sort_network_8;
+  }
+  *pn_pairs=sizeof(auch_sort_network_16)/sizeof(auch_sort_network_16[0]);
+  return auch_sort_network_16;
+}
+
 void maxim_sort_ascend(int32_t  *pn_x, int32_t n_size) 
 /**
 * \brief        Sort array
 * \par          Details
-*               Sort array in ascending order (insertion sort algorithm)
+*               Sort array in ascending order. Arrays of up to MAXIM_MAX_SORT_SIZE elements go through a
+*               fixed sorting network, so the cost does not depend on the input order; longer arrays use
+*               insertion sort.
 *
 * \retval       None
 */
 {
-  int32_t i, j, n_temp;
+  int32_t i, j, n_temp, n_pairs, n_a, n_b;
+  const uint8_t (*puch_pairs)[2];
+
+  if (n_size<2) return;
+  if (n_size<=MAXIM_MAX_SORT_SIZE) {
+    puch_pairs=maxim_sort_network(n_size, &n_pairs);
+    for (i = 0; i < n_pairs; i++) {
+      if (puch_pairs[i][1]>=n_size) continue;
+      n_a=pn_x[puch_pairs[i][0]];
+      n_b=pn_x[puch_pairs[i][1]];
+      pn_x[puch_pairs[i][0]]= n_a<n_b ? n_a : n_b;
+      pn_x[puch_pairs[i][1]]= n_a<n_b ? n_b : n_a;
+    }
+    return;
+  }
   for (i = 1; i < n_size; i++) {
     n_temp = pn_x[i];
     for (j = i; j > 0 && n_temp < pn_x[j-1]; j--)
@@ -301,12 +633,37 @@ void maxim_sort_indices_descend(  int32_t  *pn_x, int32_t *pn_indx, int32_t n_si
 /**
 * \brief        Sort indices
 * \par          Details
-*               Sort indices according to descending order (insertion sort algorithm)
+*               Sort indices according to descending order of pn_x[]. The sort is stable: indices of equal
+*               values keep their order. Up to MAXIM_MAX_SORT_SIZE indices go through a fixed sorting network
+*               on keys combining the value with the original position; longer arrays use insertion sort.
 *
 * \retval       None
 */ 
 {
-  int32_t i, j, n_temp;
+  int32_t i, j, n_temp, n_pairs;
+  int64_t an_key[MAXIM_MAX_SORT_SIZE], n_a, n_b;
+  int32_t an_indx[MAXIM_MAX_SORT_SIZE];
+  const uint8_t (*puch_pairs)[2];
+
+  if (n_size<2) return;
+  if (n_size<=MAXIM_MAX_SORT_SIZE) {
+    // Larger values first, then lower positions first
+    for (i = 0; i < n_size; i++) {
+      an_indx[i] = pn_indx[i];
+      an_key[i] = (int64_t)pn_x[pn_indx[i]]*MAXIM_MAX_SORT_SIZE + (MAXIM_MAX_SORT_SIZE-1-i);
+    }
+    puch_pairs=maxim_sort_network(n_size, &n_pairs);
+    for (i = 0; i < n_pairs; i++) {
+      if (puch_pairs[i][1]>=n_size) continue;
+      n_a=an_key[puch_pairs[i][0]];
+      n_b=an_key[puch_pairs[i][1]];
+      an_key[puch_pairs[i][0]]= n_a>n_b ? n_a : n_b;
+      an_key[puch_pairs[i][1]]= n_a>n_b ? n_b : n_a;
+    }
+    for (i = 0; i < n_size; i++)
+      pn_indx[i] = an_indx[MAXIM_MAX_SORT_SIZE-1-(int32_t)(an_key[i]&(MAXIM_MAX_SORT_SIZE-1))];
+    return;
+  }
   for (i = 1; i < n_size; i++) {
     n_temp = pn_indx[i];
     for (j = i; j > 0 && pn_x[n_temp] > pn_x[pn_indx[j-1]]; j--)
@@ -314,7 +671,3 @@ void maxim_sort_indices_descend(  int32_t  *pn_x, int32_t *pn_indx, int32_t n_si
     pn_indx[j] = n_temp;
   }
 }
-
-
-
-
@@ -64,34 +64,81 @@
 
 #include <Arduino.h>
 
-#define FS 25    //sampling frequency
-#define BUFFER_SIZE (FS * 4) 
-#define MA4_SIZE 4 // DONOT CHANGE
-#define min(x,y) ((x) < (y) ? (x) : (y))
-
-//uch_spo2_table is approximated as  -45.060*ratioAverage* ratioAverage + 30.354 *ratioAverage + 94.845 ;
-const uint8_t uch_spo2_table[184]={ 95, 95, 95, 96, 96, 96, 97, 97, 97, 97, 97, 98, 98, 98, 98, 98, 99, 99, 99, 99, 
-              99, 99, 99, 99, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 
-              100, 100, 100, 100, 99, 99, 99, 99, 99, 99, 99, 99, 98, 98, 98, 98, 98, 98, 97, 97, 
-              97, 97, 96, 96, 96, 96, 95, 95, 95, 94, 94, 94, 93, 93, 93, 92, 92, 92, 91, 91, 
-              90, 90, 89, 89, 89, 88, 88, 87, 87, 86, 86, 85, 85, 84, 84, 83, 82, 82, 81, 81, 
-              80, 80, 79, 78, 78, 77, 76, 76, 75, 74, 74, 73, 72, 72, 71, 70, 69, 69, 68, 67, 
-              66, 66, 65, 64, 63, 62, 62, 61, 60, 59, 58, 57, 56, 56, 55, 54, 53, 52, 51, 50, 
-              49, 48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33, 31, 30, 29, 
-              28, 27, 26, 25, 23, 22, 21, 20, 19, 17, 16, 15, 14, 12, 11, 10, 9, 7, 6, 5, 
-              3, 2, 1 } ;
-static  int32_t an_x[ BUFFER_SIZE]; //ir
-static  int32_t an_y[ BUFFER_SIZE]; //red
-
+/*
+ * Every name this module exports starts with maxim_ or MAXIM_, so it can share a translation unit
+ * with algorithm_by_RF.h, whose FS differs. The sampling frequency is a run-time argument.
+ */
+#define MAXIM_FS 25     // Default sampling frequency in Hz, the one the thresholds below were tuned for
+#define MAXIM_ST 4      // Batch length in s
+#if defined(ARDUINO_AVR_UNO)
+#define MAXIM_MAX_FS MAXIM_FS // Largest sampling frequency the workspace has room for
+#else
+#define MAXIM_MAX_FS 50
+#endif
+#define MAXIM_MA4_SIZE 4 // DONOT CHANGE
+#define MAXIM_MAX_PEAKS 15 // Largest number of valleys considered per batch
+#define MAXIM_MIN_THRESHOLD 30 // Smallest valley depth accepted, in sensor counts
+#define MAXIM_MAX_SORT_SIZE 16 // Longest array the sorts handle with a sorting network, longer ones use insertion sort
+const int32_t MAXIM_BUFFER_SIZE = MAXIM_FS*MAXIM_ST; // Batch length at the default sampling frequency
+const int32_t MAXIM_MAX_BUFFER_SIZE = MAXIM_MAX_FS*MAXIM_ST; // Longest batch
 
 #if defined(ARDUINO_AVR_UNO)
 //Arduino Uno doesn't have enough SRAM to store 100 samples of IR led data and red led data in 32-bit format
 //To solve this problem, 16-bit MSB of the sampled data will be truncated.  Samples become 16-bit data.
-void maxim_heart_rate_and_oxygen_saturation(uint16_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint16_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid);
+typedef uint16_t maxim_sample_t;
 #else
-void maxim_heart_rate_and_oxygen_saturation(uint32_t *pun_ir_buffer, int32_t n_ir_buffer_length, uint32_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid);
+typedef uint32_t maxim_sample_t;
 #endif
 
+/*
+ * Workspace
+ * Scratch memory for one batch. Nothing in it survives a call, so a single workspace can be shared by
+ * every caller on the same thread, or overlaid with the workspace of another estimator that never runs
+ * at the same time. MAXIM_WORKSPACE_SIZE is the number of bytes required.
+ */
+typedef struct {
+  int32_t an_x[MAXIM_MAX_BUFFER_SIZE]; //ir, inverted and averaged for the valley search
+} maxim_workspace_t;
+const size_t MAXIM_WORKSPACE_SIZE = sizeof(maxim_workspace_t);
+
+/*
+ * Streaming valley detector
+ * Finds the IR valleys sample by sample while a batch is collected, so that only the SpO2 ratio stage
+ * is left when the batch is complete. Follows maxim_find_peaks() on the inverted, 4-point averaged
+ * signal, with three changes that make it causal: the DC level is tracked over about 2.5 s instead of
+ * taken as the batch mean, the threshold adapts to the depth of recent valleys instead of being fixed,
+ * and a refractory period replaces the removal of close peaks. Unlike the workspace, the detector keeps
+ * state from one batch to the next.
+ */
+typedef struct {
+  int32_t n_fs;                          // sampling frequency in Hz
+  int32_t n_refractory;                  // samples after a valley during which only a deeper one is kept
+  int32_t n_dc_shift;                    // DC tracked over 2^n_dc_shift samples
+  int32_t n_dc;                          // DC level of the IR signal, x16; 0 before the first sample
+  int32_t an_ac[MAXIM_MA4_SIZE];         // last inverted AC samples, for the moving average
+  int32_t n_samples;                     // samples pushed since init, counts up to MAXIM_MA4_SIZE
+  int32_t n_prev;                        // previous averaged sample
+  int32_t n_envelope;                    // depth of the deepest recent valleys, decays between them
+  int32_t n_size;                        // samples pushed in the current batch
+  int32_t n_edge_loc;                    // left edge of the rise or plateau being followed, -1 if none
+  int32_t n_edge_height;
+  int32_t n_npks;                        // valleys found in the current batch
+  int32_t an_locs[MAXIM_MAX_PEAKS];      // their locations, ascending
+  int32_t n_last_height;                 // depth of the last valley
+} maxim_peak_detector_t;
+
+void maxim_heart_rate_and_oxygen_saturation_r(maxim_workspace_t *p_work, int32_t n_fs, maxim_sample_t *pun_ir_buffer, int32_t n_ir_buffer_length, 
+                maxim_sample_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid);
+void maxim_heart_rate_and_oxygen_saturation(maxim_sample_t *pun_ir_buffer, int32_t n_ir_buffer_length, maxim_sample_t *pun_red_buffer, int32_t *pn_spo2, 
+                int8_t *pch_spo2_valid, int32_t *pn_heart_rate, int8_t *pch_hr_valid);
+
+void maxim_peak_detector_init(maxim_peak_detector_t *p_detector, int32_t n_fs);
+void maxim_peak_detector_push(maxim_peak_detector_t *p_detector, maxim_sample_t un_ir);
+void maxim_peak_detector_restart(maxim_peak_detector_t *p_detector);
+void maxim_heart_rate_and_oxygen_saturation_streamed(maxim_peak_detector_t *p_detector, maxim_sample_t *pun_ir_buffer, 
+                int32_t n_ir_buffer_length, maxim_sample_t *pun_red_buffer, int32_t *pn_spo2, int8_t *pch_spo2_valid, 
+                int32_t *pn_heart_rate, int8_t *pch_hr_valid);
+
 void maxim_find_peaks(int32_t *pn_locs, int32_t *n_npks,  int32_t  *pn_x, int32_t n_size, int32_t n_min_height, int32_t n_min_distance, int32_t n_max_num);
 void maxim_peaks_above_min_height(int32_t *pn_locs, int32_t *n_npks,  int32_t  *pn_x, int32_t n_size, int32_t n_min_height);
 void maxim_remove_close_peaks(int32_t *pn_locs, int32_t *pn_npks, int32_t *pn_x, int32_t n_min_distance);
@@ -99,4 +146,3 @@ void maxim_sort_ascend(int32_t  *pn_x, int32_t n_size);
 void maxim_sort_indices_descend(int32_t  *pn_x, int32_t *pn_indx, int32_t n_size);
 
 #endif /* ALGORITHM_H_ */
-
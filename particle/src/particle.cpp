@@ -9,6 +9,11 @@
 #include "JsonParserGeneratorRK.h"
 #include "MAX30105.h"
 #include "algorithm_by_RF.h"
+#include "algorithm_goertzel.h"
+#include "algorithm_metrics.h"
+#include "decimator.h"
+#include "heartRate.h"
+#include "spo2_algorithm.h"
 
 // Define State enum for the state machine
 enum State { IDLE, REQUEST_MEASUREMENT, SEND, WAIT, SAVE_TO_EEPROM, EMPTY };
@@ -23,6 +28,98 @@ uint32_t aun_red_buffer[RFA_BUFFER_SIZE];  // red LED sensor data
 int32_t n_heart_rate;                      // heart rate
 float n_spo2;                              // oxygen saturation
 int numSamples;                            // number of samples
+int32_t rfWindowLength = RF_MIN_WINDOW;    // RF window, grows while marginal
+rf_state_t rfState;                        // RF estimator tracking state
+rf_workspace_t rfWorkspace;                // RF estimator scratch, kept off the stack
+dec_state_t decimator;                     // sensor rate to FS decimation filter
+gz_state_t gzState;                        // Goertzel estimator state
+dm_state_t metrics;                        // perfusion, RR variability, breathing
+maxim_peak_detector_t maximDetector;       // Maxim valleys, found as samples arrive
+
+// Heart rate engines that can run on the DSP window
+enum HrEngine { HR_ENGINE_RF, HR_ENGINE_GOERTZEL, HR_ENGINE_MAXIM, HR_ENGINE_AB };
+HrEngine hrEngine = HR_ENGINE_RF;  // selected at runtime, see setHrEngine()
+
+// A/B evaluation (HR_ENGINE_AB). RF and Maxim run on the same 4 s window, RF
+// provides the readings, and the two are compared window by window.
+struct EngineStats {
+  unsigned long windows;     // windows the engine ran on
+  unsigned long valid;       // windows with a valid heart rate and SpO2
+  uint32_t acquireTicks;     // cost while the window fills, in System.ticks()
+  uint32_t lastMicros;       // cost at the end of the last window
+  uint32_t maxMicros;        // worst cost at the end of a window
+  uint64_t totalMicros;      // cost of all windows, both phases
+};
+struct AbStats {
+  EngineStats rf;
+  EngineStats maxim;
+  unsigned long bothValid;   // windows where both readings are valid
+  unsigned long agreements;  // of those, windows within the tolerances
+  float hrErrorSum;          // sum of |RF - Maxim| over bothValid windows
+  float spo2ErrorSum;
+  unsigned long overruns;    // windows in a row whose RF + Maxim cost overran
+};
+AbStats abStats;
+const int32_t abHrTolerance = 5;     // bpm, for a window to count as agreeing
+const float abSpo2Tolerance = 2;     // percent
+// The sensor FIFO keeps collecting while a window is processed. Processing
+// at the end of a window gets half of the time until the FIFO overflows, so
+// an isolated overrun loses no samples; abMaxOverruns in a row end A/B mode.
+const int sensorFifoDepth = 32;
+uint32_t processingBudgetMicros;     // set in setup() from the sensor settings
+const unsigned long abMaxOverruns = 3;
+
+// Per-beat heart rate. Every sample also goes through the PBA beat detector,
+// which gives an instantaneous reading at each beat for live displays. The
+// windowed engines stay the reference for the readings that are sent. The
+// detector loses beats under baseline wander, so a beat interval is only
+// shown if it agrees with the one before and with the last windowed reading.
+BeatDetector beatDetector;
+unsigned long sampleCount = 0;     // samples since boot, the beat time base
+unsigned long lastBeatSample = 0;  // sampleCount at the previous beat, 0 if none
+unsigned long lastBeatInterval = 0;  // interval before the last beat, 0 if none
+double beatHeartRate = 0;  // last instantaneous heart rate, 0 while unknown
+int32_t windowHeartRate = 0;  // last valid windowed heart rate, 0 while unknown
+const unsigned long minBeatInterval = FS * 60 / 220;  // samples, 220 bpm
+const unsigned long maxBeatInterval = FS * 60 / 30;   // samples, 30 bpm
+const float beatIntervalTolerance = 0.15;  // between consecutive intervals
+const float beatHrTolerance = 5;  // bpm, from the windowed heart rate
+
+// Progressive readings. While the RF window fills up, a provisional heart
+// rate is printed every provisionalStep samples once two consecutive
+// estimates agree within provisionalTolerance, until the window is final.
+bool progressiveMode = true;
+const int32_t provisionalStep = FS / 5;  // 0.2 s between estimates
+const float provisionalTolerance = 0.1;  // relative agreement required
+float lastProvisional = -999;            // previous provisional estimate
+unsigned long fingerOnMillis = 0;  // first sample with a finger, 0 while off
+bool firstReadingReported = false;  // latency reported for this contact
+bool finalReadingReported = false;  // latency reported for this contact
+
+// Estimator state carried from one measurement session to the next. Lives in
+// retained (backup) RAM, so it survives WAIT periods and resets; after a
+// power loss the magic number is missing and sessions start cold.
+struct WarmStart {
+  uint32_t magic;         // warmStartMagic when the fields below are valid
+  float peakLag;          // RF peak lag of the last valid reading, in samples
+  float heartRate;        // last valid reading
+  float spo2;
+  uint8_t ledBrightness;  // LED current the reading was taken with
+  long savedAt;           // Time.now() of the reading, 0 if time was unknown
+};
+const uint32_t warmStartMagic = 0x52465753;  // "RFWS"
+const long warmStartMaxAge = 4 * 3600;        // older state is not used, in s
+retained WarmStart warmStart;
+byte ledBrightness = 30;  // 0 = off,  255 = 50mA
+
+// Half-band stages between the sensor and the DSP window. The sensor runs at
+// 200 Hz and FS is 50 Hz: with 0 stages the MAX30102 averages 4 samples on
+// chip, with 2 stages it delivers raw samples and the decimator filters them.
+const uint8_t decimationStages = 0;
+
+// Prints every sample of the DSP window as an "ir,red" line, in the order the
+// estimators receive them, to record sessions for particle/tools
+const bool printRawSamples = false;
 
 // State variables
 State currentState = REQUEST_MEASUREMENT;
@@ -45,6 +142,19 @@ int eepromDataCount = 0;
 HttpClient http;
 http_request_t request;
 http_response_t response;
+// The configuration GET has its own request, so that it does not carry the
+// body of the last sensor POST
+http_request_t configRequest;
+http_response_t configResponse;
+int storedDataSubmitted = 0;  // stored readings sent, see submitStoredData()
+
+// Headers of the sensor POSTs. Requests run asynchronously, so the headers
+// must outlive the function that starts them.
+http_header_t sensorHeaders[] = {
+    {"Content-Type", "application/json"},
+    {"x-api-key", "3786bc99-d8f4-428c-80a3-33fd7afaf5de"},
+    {NULL, NULL}  // Terminate the headers array with NULL
+};
 JsonParserStatic<1024, 20> parser1;
 
 bool useParticlePublish = false;  // Settings variable to determine the method
@@ -67,40 +177,393 @@ int getCurrentTimeInMinutes() {
   return currentHour * 60 + currentMinute;
 }
 
-// Fetches configuration from the server
+// Applies the configuration fetched by getConfigFromServer()
+// Parameters:
+//   - httpResponse: the server response, status -1 if the request failed
+//   - context: unused
+// No return value
+void configReceived(http_response_t &httpResponse, void *context) {
+  // Check response status
+  if (httpResponse.status == 200) {
+    parser1.clear();
+    parser1.addString(httpResponse.body);
+    // Parse the JSON response
+    if (parser1.parse()) {
+      // Update measurementInterval, startTime, and endTime
+      measurementInterval =
+          parser1.getReference().key("measurementInterval").valueInt() *
+          60000;
+      startTime = parser1.getReference().key("startTime").valueString();
+      endTime = parser1.getReference().key("endTime").valueString();
+    } else {
+      Serial.println("Failed to parse JSON response.");
+    }
+  } else {
+    Serial.print("Status code: ");
+    Serial.println(httpResponse.status);
+  }
+}
+
+// Fetches configuration from the server. The request runs in the
+// background, see configReceived()
 // No parameters
 // No return value
 void getConfigFromServer() {
   if (Particle.connected()) {
+    // Another request is in flight; the configuration is fetched again
+    // after the next window
+    if (http.busy()) {
+      return;
+    }
     // Configure the request
-    request.hostname = "ec2-3-143-111-57.us-east-2.compute.amazonaws.com";
-    request.port = 3000;  // Your server's port
-    request.path = "/users/device/" + System.deviceID();
-    // Send the GET request
-    http.get(request, response);
-
-    // Check response status
-    if (response.status == 200) {
-      parser1.clear();
-      parser1.addString(response.body);
-      // Parse the JSON response
-      if (parser1.parse()) {
-        // Update measurementInterval, startTime, and endTime
-        measurementInterval =
-            parser1.getReference().key("measurementInterval").valueInt() *
-            60000;
-        startTime = parser1.getReference().key("startTime").valueString();
-        endTime = parser1.getReference().key("endTime").valueString();
-      } else {
-        Serial.println("Failed to parse JSON response.");
-      }
+    configRequest.hostname =
+        "ec2-3-143-111-57.us-east-2.compute.amazonaws.com";
+    configRequest.port = 3000;  // Your server's port
+    configRequest.path = "/users/device/" + System.deviceID();
+    // Start the GET request
+    http.getAsync(configRequest, configResponse, NULL, configReceived);
+  } else {
+    Serial.println("Not connected to the cloud");
+  }
+}
+
+// Seeds the RF estimator from the previous session, if there is one
+// No parameters
+// Returns: true if the estimator was warm started
+bool warmStartEstimator() {
+  bool fresh = warmStart.magic == warmStartMagic;
+  if (fresh && warmStart.savedAt != 0 && Time.isValid()) {
+    fresh = Time.now() - warmStart.savedAt <= warmStartMaxAge;
+  }
+  dm_init(&metrics);
+  if (!fresh) {
+    rf_init_state(&rfState);
+    return false;
+  }
+  return rf_warm_start(&rfState, warmStart.peakLag);
+}
+
+// Remembers a valid RF reading for the next session
+// No parameters
+// No return value
+void saveWarmStart() {
+  warmStart.peakLag = rfState.f_last_peak_interval;
+  warmStart.heartRate = rfState.f_heart_rate;
+  warmStart.spo2 = n_spo2;
+  warmStart.ledBrightness = ledBrightness;
+  warmStart.savedAt = Time.isValid() ? Time.now() : 0;
+  warmStart.magic = warmStartMagic;
+}
+
+// Selects the heart rate engine, exposed as the "hrEngine" cloud function
+// Parameters:
+//   - engine: "rf", "goertzel", "maxim" or "ab" to compare RF and Maxim
+// Returns: 0 on success, -1 for an unknown engine
+int setHrEngine(String engine) {
+  if (engine == "rf") {
+    warmStartEstimator();
+    hrEngine = HR_ENGINE_RF;
+  } else if (engine == "goertzel") {
+    gz_init(&gzState);
+    hrEngine = HR_ENGINE_GOERTZEL;
+  } else if (engine == "maxim") {
+    maxim_peak_detector_init(&maximDetector, MAXIM_FS);
+    hrEngine = HR_ENGINE_MAXIM;
+  } else if (engine == "ab") {
+    warmStartEstimator();
+    maxim_peak_detector_init(&maximDetector, MAXIM_FS);
+    memset(&abStats, 0, sizeof(abStats));
+    hrEngine = HR_ENGINE_AB;
+  } else {
+    return -1;
+  }
+  numSamples = 0;  // start a fresh window with the new engine
+  rfWindowLength = RF_MIN_WINDOW;
+  return 0;
+}
+
+// Reports the time from finger-on to a reading, once per contact
+// Parameters:
+//   - kind: "first" for the first valid provisional or final reading,
+//     "final" for the first valid final reading
+//   - reported: flag remembering that this latency was already reported
+// No return value
+void reportLatency(const char *kind, bool *reported) {
+  if (*reported || fingerOnMillis == 0) {
+    return;
+  }
+  *reported = true;
+  Serial.print("Finger-on to ");
+  Serial.print(kind);
+  Serial.print(" reading: ");
+  Serial.print(millis() - fingerOnMillis);
+  Serial.println(" ms");
+}
+
+// Tracks finger contact and restarts the window when a finger arrives, so
+// that progressive readings start from the first sample with a pulse
+// Parameters:
+//   - sample: the sample just stored at aun_ir_buffer[numSamples - 1]
+// No return value
+void trackFingerContact(uint32_t sample) {
+  if (sample < min_ir_dc) {
+    fingerOnMillis = 0;
+    firstReadingReported = false;
+    finalReadingReported = false;
+    lastProvisional = -999;
+  } else if (fingerOnMillis == 0) {
+    fingerOnMillis = millis();
+    aun_ir_buffer[0] = aun_ir_buffer[numSamples - 1];
+    aun_red_buffer[0] = aun_red_buffer[numSamples - 1];
+    numSamples = 1;
+    rfWindowLength = RF_MIN_WINDOW;
+    if (rfState.f_track_lag <= 0) {
+      warmStartEstimator();  // lost the pulse while the finger was off
     } else {
-      Serial.print("Status code: ");
-      Serial.println(response.status);
+      dm_init(&metrics);  // beat times restart with the window
+    }
+  }
+}
+
+// Feeds a sample to the beat detector and prints the instantaneous heart rate
+// at each beat. Beats are dropped while there is no finger on the sensor, and
+// beatHeartRate keeps its value unless the interval passes the checks above.
+// Parameters:
+//   - sample: the IR sample just stored
+// No return value
+void trackBeats(uint32_t sample) {
+  sampleCount++;
+  if (sample < min_ir_dc) {
+    beatDetector.reset();
+    lastBeatSample = 0;
+    lastBeatInterval = 0;
+    beatHeartRate = 0;
+    windowHeartRate = 0;
+    return;
+  }
+  if (!beatDetector.checkForBeat(sample)) {
+    return;
+  }
+  unsigned long beatInterval = sampleCount - lastBeatSample;
+  bool firstBeat = lastBeatSample == 0;
+  lastBeatSample = sampleCount;
+  if (firstBeat || beatInterval < minBeatInterval ||
+      beatInterval > maxBeatInterval) {
+    lastBeatInterval = 0;
+    return;
+  }
+  bool consistent =
+      lastBeatInterval != 0 &&
+      fabs((float)beatInterval - lastBeatInterval) <=
+          beatIntervalTolerance * lastBeatInterval;
+  lastBeatInterval = beatInterval;
+  double heartRate = 60.0 * FS / beatInterval;
+  if (!consistent || windowHeartRate <= 0 ||
+      fabs(heartRate - windowHeartRate) > beatHrTolerance) {
+    return;
+  }
+  beatHeartRate = heartRate;
+  Serial.print("Beat at ");
+  Serial.print(millis());
+  Serial.print(" ms, ");
+  Serial.print(beatHeartRate);
+  Serial.println(" bpm");
+}
+
+// Prints a provisional heart rate from the part of the RF window collected
+// so far, if it agrees with the previous estimate
+// No parameters
+// No return value
+void printProvisionalReading() {
+  float provisional, provisionalRatio;
+  if (!rf_provisional_heart_rate(&rfWorkspace, aun_ir_buffer, numSamples,
+                                 &provisional, &provisionalRatio)) {
+    lastProvisional = -999;
+    return;
+  }
+  bool agrees = lastProvisional > 0 &&
+                fabs(provisional - lastProvisional) <=
+                    provisionalTolerance * lastProvisional;
+  lastProvisional = provisional;
+  if (!agrees) {
+    return;
+  }
+  Serial.print("Pulse ");
+  Serial.print(provisional);
+  Serial.print(" (provisional, ");
+  Serial.print((float)numSamples / FS);
+  Serial.println(" s)");
+  reportLatency("first", &firstReadingReported);
+}
+
+// The Maxim engine runs at MAXIM_FS, the rate its thresholds were tuned for.
+// Samples are averaged down by this factor.
+const int32_t maximDecimation = FS / MAXIM_FS;
+
+// Averages the last maximDecimation samples of the window down to one sample
+// at MAXIM_FS
+// Parameters:
+//   - buffer: aun_ir_buffer or aun_red_buffer
+//   - end: number of samples of the window to average the last ones of
+// Returns: the averaged sample
+uint32_t maximSample(const uint32_t *buffer, int32_t end) {
+  uint32_t sum = 0;
+  for (int32_t j = end - maximDecimation; j < end; j++) {
+    sum += buffer[j];
+  }
+  return sum / maximDecimation;
+}
+
+// Runs the Maxim engine on the full window. Its valleys were found while the
+// window filled, so only the SpO2 ratio stage is left. The window is averaged
+// down in place first; it is refilled from the start afterwards anyway.
+// Parameters:
+//   - spo2, spo2Valid: receive the SpO2 and its validity
+//   - heartRate, hrValid: receive the heart rate and its validity
+// No return value
+void maximHeartRateAndOxygenSaturation(float *spo2, int8_t *spo2Valid,
+                                       int32_t *heartRate, int8_t *hrValid) {
+  for (int32_t i = 0; i < MAXIM_BUFFER_SIZE; i++) {
+    uint32_t ir = maximSample(aun_ir_buffer, (i + 1) * maximDecimation);
+    aun_red_buffer[i] = maximSample(aun_red_buffer, (i + 1) * maximDecimation);
+    aun_ir_buffer[i] = ir;
+  }
+  int32_t maximSpo2;
+  maxim_heart_rate_and_oxygen_saturation_streamed(
+      &maximDetector, aun_ir_buffer, MAXIM_BUFFER_SIZE, aun_red_buffer,
+      &maximSpo2, spo2Valid, heartRate, hrValid);
+  *spo2 = maximSpo2;
+}
+
+// Converts a System.ticks() interval to microseconds
+// Parameters:
+//   - startTicks: System.ticks() at the start of the interval
+// Returns: the microseconds elapsed since then
+uint32_t elapsedMicros(uint32_t startTicks) {
+  return (System.ticks() - startTicks) / System.ticksPerMicrosecond();
+}
+
+// Adds one window of an engine to the A/B statistics
+// Parameters:
+//   - stats: the engine's statistics
+//   - micros: cost at the end of the window
+//   - valid: whether both heart rate and SpO2 were valid
+// No return value
+void recordEngineWindow(EngineStats *stats, uint32_t micros, bool valid) {
+  stats->windows++;
+  if (valid) stats->valid++;
+  stats->lastMicros = micros;
+  if (micros > stats->maxMicros) stats->maxMicros = micros;
+  stats->totalMicros +=
+      stats->acquireTicks / System.ticksPerMicrosecond() + micros;
+  stats->acquireTicks = 0;
+}
+
+// Prints the cost and validity of an engine in the A/B comparison
+// Parameters:
+//   - name: engine name
+//   - stats: the engine's statistics
+// No return value
+void printEngineStats(const char *name, const EngineStats *stats) {
+  Serial.print(name);
+  Serial.print(" valid ");
+  Serial.print(stats->valid);
+  Serial.print("/");
+  Serial.print(stats->windows);
+  Serial.print(", ");
+  Serial.print(stats->lastMicros);
+  Serial.print(" us at window end (worst ");
+  Serial.print(stats->maxMicros);
+  Serial.print("), mean ");
+  Serial.print(stats->windows ? (uint32_t)(stats->totalMicros / stats->windows)
+                              : 0);
+  Serial.println(" us per window");
+}
+
+// Runs RF and Maxim on the same window and compares them. RF runs first and
+// provides the readings. If the two together overrun processingBudgetMicros
+// in abMaxOverruns windows in a row, the mode falls back to RF alone.
+// Parameters:
+//   - spo2Valid, hrValid: receive the validity of the RF n_spo2 and
+//     n_heart_rate
+//   - ratio, correl: receive the RF ratio and correlation
+// No return value
+void abHeartRateAndOxygenSaturation(int8_t *spo2Valid, int8_t *hrValid,
+                                    float *ratio, float *correl) {
+  uint32_t start = System.ticks();
+  rf_heart_rate_and_oxygen_saturation_r(&rfState, &rfWorkspace, aun_ir_buffer,
+                                        RFA_BUFFER_SIZE, aun_red_buffer,
+                                        &n_spo2, spo2Valid, &n_heart_rate,
+                                        hrValid, ratio, correl);
+  uint32_t rfMicros = elapsedMicros(start);
+  recordEngineWindow(&abStats.rf, rfMicros, *spo2Valid && *hrValid);
+
+  float maximSpo2;
+  int32_t maximHeartRate;
+  int8_t maximSpo2Valid, maximHrValid;
+  start = System.ticks();
+  maximHeartRateAndOxygenSaturation(&maximSpo2, &maximSpo2Valid,
+                                    &maximHeartRate, &maximHrValid);
+  uint32_t maximMicros = elapsedMicros(start);
+  recordEngineWindow(&abStats.maxim, maximMicros,
+                     maximSpo2Valid && maximHrValid);
+
+  if (rfMicros + maximMicros > processingBudgetMicros) {
+    abStats.overruns++;
+    Serial.print("A/B: RF ");
+    Serial.print(rfMicros);
+    Serial.print(" us + Maxim ");
+    Serial.print(maximMicros);
+    Serial.print(" us exceeds the ");
+    Serial.print(processingBudgetMicros);
+    Serial.print(" us budget, ");
+    Serial.print(abStats.overruns);
+    Serial.print("/");
+    Serial.print(abMaxOverruns);
+    Serial.println(" windows in a row");
+    if (abStats.overruns >= abMaxOverruns) {
+      Serial.println("A/B: sustained overrun, continuing with RF only");
+      hrEngine = HR_ENGINE_RF;
+      rfWindowLength = RF_MIN_WINDOW;
     }
   } else {
-    Serial.println("Not connected to the cloud");
+    abStats.overruns = 0;
+  }
+
+  Serial.print("A/B: Maxim pulse ");
+  if (maximHrValid)
+    Serial.print(maximHeartRate);
+  else
+    Serial.print("x");
+  Serial.print(", SP02 ");
+  if (maximSpo2Valid)
+    Serial.print(maximSpo2);
+  else
+    Serial.print("x");
+  if (*spo2Valid && *hrValid && maximSpo2Valid && maximHrValid) {
+    int32_t hrError = abs(n_heart_rate - maximHeartRate);
+    float spo2Error = fabs(n_spo2 - maximSpo2);
+    abStats.bothValid++;
+    abStats.hrErrorSum += hrError;
+    abStats.spo2ErrorSum += spo2Error;
+    if (hrError <= abHrTolerance && spo2Error <= abSpo2Tolerance) {
+      abStats.agreements++;
+    }
+  }
+  Serial.print(", agreement ");
+  Serial.print(abStats.agreements);
+  Serial.print("/");
+  Serial.print(abStats.bothValid);
+  if (abStats.bothValid) {
+    Serial.print(", mean difference ");
+    Serial.print(abStats.hrErrorSum / abStats.bothValid);
+    Serial.print(" bpm, ");
+    Serial.print(abStats.spo2ErrorSum / abStats.bothValid);
+    Serial.print(" %");
   }
+  Serial.println();
+  printEngineStats("A/B: RF", &abStats.rf);
+  printEngineStats("A/B: Maxim", &abStats.maxim);
 }
 
 // Handles configuration update events
@@ -134,6 +597,26 @@ void saveDataToEEPROM(float averageBPM, float averageSPO2) {
   Serial.println("DATA SAVED to EEPROM");
 }
 
+// Handles the result of the sensor POST started by sendDataParticle()
+// Parameters:
+//   - httpResponse: the server response, status -1 if the request failed
+//   - context: unused
+// No return value
+void sensorDataSent(http_response_t &httpResponse, void *context) {
+  if (httpResponse.status == 201) {
+    Serial.println("DATA SENT to server");
+    dataSent = true;
+    dataSentCount++;
+
+    currentState = EMPTY;
+
+  } else {
+    Serial.print("Failed to send data. Status code: ");
+    Serial.println(httpResponse.status);
+    currentState = SAVE_TO_EEPROM;
+  }
+}
+
 // Sends data to the server or Particle Cloud
 // Parameters:
 //   - averageBPM: the average beats per minute to send
@@ -167,6 +650,11 @@ void sendDataParticle(float averageBPM, float averageSPO2) {
     }
   } else {
     if (dataSentCount == 0) {
+      // The state stays SEND until sensorDataSent() gets the result; while
+      // a request is in flight, try again at the next tick
+      if (http.busy()) {
+        return;
+      }
       // Send direct POST request
       request.hostname = "ec2-3-143-111-57.us-east-2.compute.amazonaws.com";
       request.port = 3000;
@@ -175,26 +663,7 @@ void sendDataParticle(float averageBPM, float averageSPO2) {
                      "\",\"data\":{\"bpm\":" + String(averageBPM) +
                      ",\"spo2\":" + String(averageSPO2) + "}}";
 
-      http_header_t headers[] = {
-          {"Content-Type", "application/json"},
-          {"x-api-key", "3786bc99-d8f4-428c-80a3-33fd7afaf5de"},
-          {NULL, NULL}  // Terminate the headers array with NULL
-      };
-
-      http.post(request, response, headers);
-
-      if (response.status == 201) {
-        Serial.println("DATA SENT to server");
-        dataSent = true;
-        dataSentCount++;
-
-        currentState = EMPTY;
-
-      } else {
-        Serial.print("Failed to send data. Status code: ");
-        Serial.println(response.status);
-        currentState = SAVE_TO_EEPROM;
-      }
+      http.postAsync(request, response, sensorHeaders, sensorDataSent);
     } else if (dataSentCount >= 2) {
       currentState = WAIT;
       stateStartMillis = millis();
@@ -206,17 +675,37 @@ void sendDataParticle(float averageBPM, float averageSPO2) {
   }
 }
 
-// Submits stored data to the server from EEPROM
+// Handles the result of a stored reading POST started by submitStoredData()
+// Parameters:
+//   - httpResponse: the server response, status -1 if the request failed
+//   - context: unused
+// No return value
+void storedDataSent(http_response_t &httpResponse, void *context) {
+  if (httpResponse.status == 201) {
+    Serial.println("STORED DATA SENT to server");
+  } else {
+    Serial.print("Failed to send stored data. Status code: ");
+    Serial.println(httpResponse.status);
+  }
+  storedDataSubmitted++;
+  if (storedDataSubmitted >= eepromDataCount) {
+    eepromDataCount = 0;  // Reset the count after submitting all data
+    storedDataSubmitted = 0;
+  }
+}
+
+// Submits stored data to the server from EEPROM. Server POSTs go out one at
+// a time in the background, see storedDataSent()
 // No parameters
 // No return value
 void submitStoredData() {
-  for (int i = 0; i < eepromDataCount; i++) {
-    int address = i * sizeof(float) * 2;
-    float storedBPM, storedSPO2;
-    EEPROM.get(address, storedBPM);
-    EEPROM.get(address + sizeof(float), storedSPO2);
+  if (useParticlePublish) {
+    for (int i = 0; i < eepromDataCount; i++) {
+      int address = i * sizeof(float) * 2;
+      float storedBPM, storedSPO2;
+      EEPROM.get(address, storedBPM);
+      EEPROM.get(address + sizeof(float), storedSPO2);
 
-    if (useParticlePublish) {
       Particle.publish("bpm", String(storedBPM), PRIVATE);
       Particle.publish("spo2", String(storedSPO2), PRIVATE);
       Particle.publish("bpm_spo2",
@@ -225,31 +714,27 @@ void submitStoredData() {
                        PRIVATE);
 
       Serial.println("STORED DATA SENT to Particle Cloud");
-    } else {
-      // Send direct POST request
-      request.hostname = "ec2-3-143-111-57.us-east-2.compute.amazonaws.com";
-      request.port = 3000;
-      request.path = "/sensor";
-      request.body = "{\"device_id\":\"" + System.deviceID() +
-                     "\",\"data\":{\"bpm\":" + String(storedBPM) +
-                     ",\"spo2\":" + String(storedSPO2) + "}}";
-      http_header_t headers[] = {
-          {"Content-Type", "application/json"},
-          {"x-api-key", "3786bc99-d8f4-428c-80a3-33fd7afaf5de"},
-          {NULL, NULL}  // Terminate the headers array with NULL
-      };
-
-      http.post(request, response, headers);
-
-      if (response.status == 201) {
-        Serial.println("STORED DATA SENT to server");
-      } else {
-        Serial.print("Failed to send stored data. Status code: ");
-        Serial.println(response.status);
-      }
     }
+    eepromDataCount = 0;  // Reset the count after submitting all data
+    return;
+  }
+
+  if (http.busy()) {
+    return;
   }
-  eepromDataCount = 0;  // Reset the count after submitting all data
+  int address = storedDataSubmitted * sizeof(float) * 2;
+  float storedBPM, storedSPO2;
+  EEPROM.get(address, storedBPM);
+  EEPROM.get(address + sizeof(float), storedSPO2);
+
+  // Send direct POST request
+  request.hostname = "ec2-3-143-111-57.us-east-2.compute.amazonaws.com";
+  request.port = 3000;
+  request.path = "/sensor";
+  request.body = "{\"device_id\":\"" + System.deviceID() +
+                 "\",\"data\":{\"bpm\":" + String(storedBPM) +
+                 ",\"spo2\":" + String(storedSPO2) + "}}";
+  http.postAsync(request, response, sensorHeaders, storedDataSent);
 }
 
 // Checks and resets EEPROM data after 24 hours
@@ -286,8 +771,10 @@ void setup() {
     }
   }
 
-  byte ledBrightness = 30;  // 0 = off,  255 = 50mA
-  byte sampleAverage = 4;   // 1, 2, 4, 8, 16, 32
+  if (warmStart.magic == warmStartMagic && warmStart.ledBrightness != 0) {
+    ledBrightness = warmStart.ledBrightness;
+  }
+  byte sampleAverage = 4 >> decimationStages;  // 1, 2, 4, 8, 16, 32
   byte ledMode =
       2;  // 1 = Red only, 2 = Red + IR, 3 = Red + IR + Green (MAX30105 only)
   int sampleRate = 200;  // 50, 100, 200, 400, 800, 1000, 1600, 3200
@@ -296,9 +783,21 @@ void setup() {
 
   sensor.setup(ledBrightness, sampleAverage, ledMode, sampleRate, pulseWidth,
                adcRange);
+  processingBudgetMicros =
+      (uint32_t)(500000.0 * sensorFifoDepth * sampleAverage / sampleRate);
   sensor.getINT1();  // clear the status registers by reading
   sensor.getINT2();  // clear the status registers by reading
   numSamples = 0;
+  dec_init(&decimator, decimationStages);
+  if (warmStartEstimator()) {
+    Serial.print("Warm start from pulse ");
+    Serial.print(warmStart.heartRate);
+    Serial.print(", SP02 ");
+    Serial.println(warmStart.spo2);
+  }
+  gz_init(&gzState);
+  Particle.function("hrEngine", setHrEngine);
+  Particle.variable("beatBpm", beatHeartRate);
   stateStartMillis = millis();
 }
 
@@ -307,27 +806,93 @@ void loop() {
   int8_t ch_spo2_valid;
   int8_t ch_hr_valid;
 
+  // Advance the HTTP request in flight, if any. Requests run in the
+  // background, so the sensor FIFO keeps being read while they wait
+  http.poll();
+
   sensor.check();
   while (sensor.available()) {
-    // Read the sensor data and store it in the buffer
-    aun_red_buffer[numSamples] = sensor.getFIFOIR();
-    aun_ir_buffer[numSamples] = sensor.getFIFORed();
+    // Read the sensor data, decimate it to FS and store it in the buffer
+    int8_t decimated = dec_push(&decimator, sensor.getFIFOIR(),
+                                sensor.getFIFORed(), &aun_red_buffer[numSamples],
+                                &aun_ir_buffer[numSamples]);
+    sensor.nextSample();
+    if (!decimated) {
+      continue;
+    }
+    if (hrEngine == HR_ENGINE_GOERTZEL) {
+      gz_push(&gzState, aun_ir_buffer[numSamples], aun_red_buffer[numSamples]);
+    }
 
     numSamples++;
-    sensor.nextSample();
+    if (printRawSamples) {
+      Serial.print(aun_ir_buffer[numSamples - 1]);
+      Serial.print(",");
+      Serial.println(aun_red_buffer[numSamples - 1]);
+    }
+    trackBeats(aun_ir_buffer[numSamples - 1]);
+    if ((hrEngine == HR_ENGINE_MAXIM || hrEngine == HR_ENGINE_AB) &&
+        numSamples % maximDecimation == 0) {
+      uint32_t start = System.ticks();
+      maxim_peak_detector_push(&maximDetector,
+                               maximSample(aun_ir_buffer, numSamples));
+      abStats.maxim.acquireTicks += System.ticks() - start;
+    }
+    if (progressiveMode && hrEngine == HR_ENGINE_RF) {
+      trackFingerContact(aun_ir_buffer[numSamples - 1]);
+    }
 
     // If we have enough samples, calculate the heart rate and SpO2
     // Buffer size : Sampling Time (ST) * Sampling Frequency (FS)
-    // ST = 4 seconds and FS = 50 Hz, buffer size = 200
-    if (numSamples == RFA_BUFFER_SIZE) {
-      rf_heart_rate_and_oxygen_saturation(
-          aun_ir_buffer, RFA_BUFFER_SIZE, aun_red_buffer, &n_spo2,
-          &ch_spo2_valid, &n_heart_rate, &ch_hr_valid, &ratio, &correl);
+    // ST = 4 seconds and FS = 50 Hz, buffer size = 200. The RF engine starts
+    // with a 2 s window and extends it by 1 s while the signal is marginal.
+    int32_t windowLength =
+        hrEngine == HR_ENGINE_RF ? rfWindowLength : RFA_BUFFER_SIZE;
+    if (progressiveMode && hrEngine == HR_ENGINE_RF &&
+        numSamples < windowLength && numSamples % provisionalStep == 0) {
+      printProvisionalReading();
+    }
+    if (numSamples == windowLength) {
+      if (hrEngine == HR_ENGINE_GOERTZEL) {
+        float gzHeartRate, purity;
+        gz_heart_rate_and_oxygen_saturation(&gzState, &n_spo2, &ch_spo2_valid,
+                                            &n_heart_rate, &ch_hr_valid,
+                                            &gzHeartRate, &purity);
+      } else if (hrEngine == HR_ENGINE_MAXIM) {
+        maximHeartRateAndOxygenSaturation(&n_spo2, &ch_spo2_valid,
+                                          &n_heart_rate, &ch_hr_valid);
+      } else if (hrEngine == HR_ENGINE_AB) {
+        abHeartRateAndOxygenSaturation(&ch_spo2_valid, &ch_hr_valid, &ratio,
+                                       &correl);
+      } else if (!rf_adaptive_window_r(&rfState, &rfWorkspace, aun_ir_buffer,
+                                       windowLength, aun_red_buffer, &n_spo2,
+                                       &ch_spo2_valid, &n_heart_rate,
+                                       &ch_hr_valid, &ratio, &correl)) {
+        rfWindowLength += RF_WINDOW_STEP;  // marginal, keep collecting
+        continue;
+      }
+      if (hrEngine == HR_ENGINE_RF) {
+        // Reuses the detrended window left in rfWorkspace
+        dm_update(&metrics, &rfState, &rfWorkspace, windowLength, ch_hr_valid);
+        if (ch_hr_valid && ch_spo2_valid) {
+          saveWarmStart();
+        }
+      }
+      if (ch_hr_valid) {
+        windowHeartRate = n_heart_rate;  // reference for the beat detector
+      }
 
       // If spo2_valid and hr_valid are true, then we have a valid result
       if (ch_spo2_valid && ch_hr_valid && currentState != WAIT) {
         currentState = SEND;
       }
+      if (progressiveMode && hrEngine == HR_ENGINE_RF) {
+        if (ch_hr_valid) {
+          reportLatency("first", &firstReadingReported);
+          reportLatency("final", &finalReadingReported);
+        }
+        lastProvisional = -999;
+      }
       printCurrentTime();
 
       Serial.print("SP02 ");
@@ -340,11 +905,39 @@ void loop() {
         Serial.print(n_heart_rate);
       else
         Serial.print("x");
+      Serial.print(progressiveMode ? ", final window " : ", window ");
+      Serial.print((float)windowLength / FS);
+      Serial.print(" s");
+      if (hrEngine == HR_ENGINE_RF || hrEngine == HR_ENGINE_AB) {
+        if (rfState.uch_last_screen != RF_SCREEN_OK) {
+          Serial.print(" (screened out, reason ");
+          Serial.print(rfState.uch_last_screen);
+          Serial.print(")");
+        }
+        Serial.print(", rejection rate ");
+        Serial.print(rf_rejection_rate(&rfState));
+      }
+      if (hrEngine == HR_ENGINE_RF && ch_hr_valid) {
+        Serial.print(", PI ");
+        Serial.print(metrics.f_perfusion_index);
+        Serial.print(" %, RMSSD ");
+        if (metrics.f_rmssd >= 0)
+          Serial.print(metrics.f_rmssd);
+        else
+          Serial.print("x");
+        Serial.print(" ms, breathing ");
+        if (metrics.f_respiratory_rate >= 0)
+          Serial.print(metrics.f_respiratory_rate);
+        else
+          Serial.print("x");
+        Serial.print("/min");
+      }
       Serial.println();
       getConfigFromServer();
       numSamples = 0;
-      // toggle the board LED. This should happen every ST (= 4) seconds if
-      // MAX30102 has been configured correctly
+      rfWindowLength = RF_MIN_WINDOW;
+      // toggle the board LED. This should happen every 2 to ST (= 4) seconds
+      // if MAX30102 has been configured correctly
     }
   }
 
@@ -388,6 +981,11 @@ void loop() {
           if (currentMillis - stateStartMillis >= measurementInterval) {
             currentState = REQUEST_MEASUREMENT;
             stateStartMillis = millis();
+            if (hrEngine == HR_ENGINE_RF) {
+              warmStartEstimator();
+              numSamples = 0;
+              rfWindowLength = RF_MIN_WINDOW;
+            }
           } else {
             if (ledState) {
               RGB.color(0, 0, 0);  // off
@@ -0,0 +1,21 @@
+#include "alloc_counter.h"
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <new>
+
+static std::atomic<unsigned long> allocations(0);
+
+unsigned long allocationCount() { return allocations; }
+
+void *operator new(size_t size) {
+  allocations++;
+  void *p = malloc(size ? size : 1);
+  if (p == NULL) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+void operator delete(void *p, size_t) noexcept { free(p); }
@@ -0,0 +1,9 @@
+// Counts heap allocations made through operator new, for the benchmarks.
+// Linking alloc_counter.cpp replaces the global operator new and delete.
+#ifndef ALLOC_COUNTER_H_
+#define ALLOC_COUNTER_H_
+
+// Returns: the number of operator new calls since start-up
+unsigned long allocationCount();
+
+#endif /* ALLOC_COUNTER_H_ */
@@ -0,0 +1,15 @@
+// Minimal stand-in for the Arduino/Device OS header so that the signal
+// processing sources in lib/MAX30105_Bearcat/src build on a Linux host.
+// Only what those sources use is provided here.
+#ifndef HOST_ARDUINO_H_
+#define HOST_ARDUINO_H_
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+
+#endif /* HOST_ARDUINO_H_ */
@@ -0,0 +1,680 @@
+// Benchmarks the heart rate/SpO2 algorithms for cost and accuracy.
+//
+// Usage: ppg_bench [-n repetitions] [-o results.json] [recorded...]
+//
+// Every algorithm is run at each of its supported FS/ST settings over a set
+// of synthetic traces with known heart rate and SpO2, and over recorded
+// sessions (see ppg_engine.h for the format): those given on the command
+// line, or else those in tools/recorded. A recorded session is labeled by a
+// comment line such as "# hr=72 spo2=97"; unlabeled sessions only contribute
+// to timing.
+//
+// Reports nanoseconds and heap allocations per window, the fraction of
+// windows with a valid result within hrTolerance/spo2Tolerance of the label
+// and the mean absolute HR/SpO2 error of all windows reported valid. The table goes to stdout, the same rows as JSON to -o. A second
+// table gives the worst-case cost of the small per-batch kernels.
+
+#include <math.h>
+#include <stdio.h>
+#include <glob.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "algorithm_goertzel.h"
+#include "alloc_counter.h"
+#include "heartRate.h"
+#include "ppg_engine.h"
+#include "spo2_algorithm.h"
+
+// Sampling frequency of all traces, as delivered by the firmware
+static const int32_t TRACE_FS = FS;
+
+// Largest errors of a valid result that still count as a correct reading
+static const float hrTolerance = 5;    // bpm
+static const float spo2Tolerance = 3;  // percent
+
+// A recording of raw sensor counts at TRACE_FS with its reference values
+struct Trace {
+  std::string name;
+  bool synthetic;
+  float heartRate;  // NAN if unlabeled
+  float spo2;       // NAN if unlabeled
+  std::vector<uint32_t> ir;
+  std::vector<uint32_t> red;
+};
+
+// Result of one window
+struct Estimate {
+  float heartRate;
+  bool hrValid;
+  float spo2;
+  bool spo2Valid;
+};
+
+// An algorithm under test, run one window at a time
+class Estimator {
+ public:
+  virtual ~Estimator() {}
+  // Returns: the name used in reports
+  virtual const char *name() const = 0;
+  // Puts the estimator into its cold-start state before a new trace
+  virtual void reset() = 0;
+  // Processes one window at the case's sampling frequency
+  // Parameters:
+  //   - ir, red: the next n samples of the trace
+  //   - n: samples available, the case's window length
+  //   - estimate: receives the result
+  // Returns: the samples the window actually used, at most n
+  virtual int32_t process(uint32_t *ir, uint32_t *red, int32_t n,
+                          Estimate *estimate) = 0;
+};
+
+// Robert Fraczkiewicz's autocorrelation estimator
+class RfEstimator : public Estimator {
+ public:
+  const char *name() const { return "rf"; }
+  void reset() { rf_init_state(&state); }
+  int32_t process(uint32_t *ir, uint32_t *red, int32_t n, Estimate *estimate) {
+    float spo2, ratio, correl;
+    int8_t spo2Valid, hrValid;
+    int32_t heartRate;
+    rf_heart_rate_and_oxygen_saturation_r(&state, &workspace, ir, n, red,
+                                          &spo2, &spo2Valid, &heartRate,
+                                          &hrValid, &ratio, &correl);
+    estimate->heartRate = state.f_heart_rate;
+    estimate->hrValid = hrValid;
+    estimate->spo2 = spo2;
+    estimate->spo2Valid = spo2Valid;
+    return n;
+  }
+
+ private:
+  rf_state_t state;
+  rf_workspace_t workspace;
+};
+
+// Autocorrelation estimator on a window that grows from RF_MIN_WINDOW while
+// the signal is marginal, see rf_adaptive_window_r()
+class AdaptiveRfEstimator : public Estimator {
+ public:
+  const char *name() const { return "rf-adapt"; }
+  void reset() { rf_init_state(&state); }
+  int32_t process(uint32_t *ir, uint32_t *red, int32_t n, Estimate *estimate) {
+    float spo2, ratio, correl;
+    int8_t spo2Valid, hrValid;
+    int32_t heartRate;
+    int32_t length = RF_MIN_WINDOW;
+    while (!rf_adaptive_window_r(&state, &workspace, ir, length, red, &spo2,
+                                 &spo2Valid, &heartRate, &hrValid, &ratio,
+                                 &correl) &&
+           length + RF_WINDOW_STEP <= n) {
+      length += RF_WINDOW_STEP;
+    }
+    estimate->heartRate = state.f_heart_rate;
+    estimate->hrValid = hrValid;
+    estimate->spo2 = spo2;
+    estimate->spo2Valid = spo2Valid;
+    return length;
+  }
+
+ private:
+  rf_state_t state;
+  rf_workspace_t workspace;
+};
+
+// Goertzel filter bank, fed sample by sample
+class GoertzelEstimator : public Estimator {
+ public:
+  const char *name() const { return "goertzel"; }
+  void reset() { gz_init(&state); }
+  int32_t process(uint32_t *ir, uint32_t *red, int32_t n, Estimate *estimate) {
+    float spo2, heartRate, purity;
+    int8_t spo2Valid, hrValid;
+    int32_t roundedHeartRate;
+    for (int32_t k = 0; k < n; k++) {
+      gz_push(&state, ir[k], red[k]);
+    }
+    gz_heart_rate_and_oxygen_saturation(&state, &spo2, &spo2Valid,
+                                        &roundedHeartRate, &hrValid,
+                                        &heartRate, &purity);
+    estimate->heartRate = heartRate;
+    estimate->hrValid = hrValid;
+    estimate->spo2 = spo2;
+    estimate->spo2Valid = spo2Valid;
+    return n;
+  }
+
+ private:
+  gz_state_t state;
+};
+
+// Maxim's peak-detecting estimator
+class MaximEstimator : public Estimator {
+ public:
+  explicit MaximEstimator(int32_t fs) : fs(fs) {}
+  const char *name() const { return "maxim"; }
+  void reset() {}
+  int32_t process(uint32_t *ir, uint32_t *red, int32_t n, Estimate *estimate) {
+    int32_t spo2, heartRate;
+    int8_t spo2Valid, hrValid;
+    maxim_heart_rate_and_oxygen_saturation_r(&workspace, fs, ir, n, red, &spo2,
+                                             &spo2Valid, &heartRate, &hrValid);
+    estimate->heartRate = heartRate;
+    estimate->hrValid = hrValid;
+    estimate->spo2 = spo2;
+    estimate->spo2Valid = spo2Valid;
+    return n;
+  }
+
+ private:
+  int32_t fs;
+  maxim_workspace_t workspace;
+};
+
+// Maxim's estimator with the valleys found sample by sample. Pushing the
+// samples is timed with the window, as it runs in the acquisition loop.
+class StreamingMaximEstimator : public Estimator {
+ public:
+  explicit StreamingMaximEstimator(int32_t fs) : fs(fs) {}
+  const char *name() const { return "maxim-s"; }
+  void reset() { maxim_peak_detector_init(&detector, fs); }
+  int32_t process(uint32_t *ir, uint32_t *red, int32_t n, Estimate *estimate) {
+    int32_t spo2, heartRate;
+    int8_t spo2Valid, hrValid;
+    for (int32_t i = 0; i < n; i++) {
+      maxim_peak_detector_push(&detector, ir[i]);
+    }
+    maxim_heart_rate_and_oxygen_saturation_streamed(
+        &detector, ir, n, red, &spo2, &spo2Valid, &heartRate, &hrValid);
+    estimate->heartRate = heartRate;
+    estimate->hrValid = hrValid;
+    estimate->spo2 = spo2;
+    estimate->spo2Valid = spo2Valid;
+    return n;
+  }
+
+ private:
+  int32_t fs;
+  maxim_peak_detector_t detector;
+};
+
+// Maxim's PBA beat detector (checkForBeat), heart rate from beat intervals
+class PbaEstimator : public Estimator {
+ public:
+  explicit PbaEstimator(int32_t fs) : fs(fs) {}
+  const char *name() const { return "pba"; }
+  void reset() {
+    detector.reset();
+    sample = 0;
+    lastBeat = -1;
+  }
+  int32_t process(uint32_t *ir, uint32_t * /*red*/, int32_t n,
+                  Estimate *estimate) {
+    uint16_t beats[32];
+    uint16_t numBeats = detector.checkForBeats(ir, n, beats, 32);
+    long intervalSum = 0;
+    int intervals = 0;
+    for (uint16_t i = 0; i < numBeats && i < 32; i++) {
+      if (lastBeat >= 0) {
+        intervalSum += sample + beats[i] - lastBeat;
+        intervals++;
+      }
+      lastBeat = sample + beats[i];
+    }
+    sample += n;
+    estimate->hrValid = intervals > 0;
+    estimate->heartRate =
+        intervals > 0 ? 60.0f * fs * intervals / intervalSum : -999;
+    estimate->spo2Valid = false;
+    estimate->spo2 = -999;
+    return n;
+  }
+
+ private:
+  int32_t fs;
+  BeatDetector detector;
+  long sample;
+  long lastBeat;
+};
+
+// An algorithm at one sampling frequency and window length
+struct BenchCase {
+  Estimator *estimator;
+  int32_t fs;  // sampling frequency in Hz
+  int32_t st;  // window length in s
+};
+
+// Accumulated results of one case over a set of traces
+struct BenchResult {
+  long windows;
+  long samples;  // samples the windows used, less than windows*fs*st if adaptive
+  double nanoseconds;
+  unsigned long allocations;
+  long labeledWindows;
+  long hrValid;     // valid and within hrTolerance
+  long hrReported;  // valid
+  double hrError;   // over the windows reported valid
+  long spo2Valid;
+  long spo2Reported;
+  double spo2Error;
+};
+
+// Deterministic noise source, so that runs are comparable
+static uint32_t noiseState = 12345;
+
+// Returns: a pseudo-random number uniformly distributed in [-1, 1)
+static float noise() {
+  noiseState = noiseState * 1664525u + 1013904223u;
+  return (noiseState >> 8) / 8388608.0f - 1.0f;
+}
+
+// Red/IR modulation ratio that the RF calibration maps to a given SpO2
+// Parameters:
+//   - spo2: oxygen saturation in percent
+// Returns: the ratio on the physiological (upper) branch of the calibration
+static float ratioForSpo2(float spo2) {
+  float a = 45.060f, b = -30.354f, c = spo2 - 94.845f;
+  return (-b + sqrtf(b * b - 4 * a * c)) / (2 * a);
+}
+
+// Generates a synthetic PPG recording
+// Parameters:
+//   - heartRate: pulse rate in bpm
+//   - spo2: oxygen saturation in percent
+//   - seconds: length of the recording
+// Returns: the trace at TRACE_FS, with a systolic and a dicrotic wave per
+//          beat, respiratory baseline wander and sensor noise. As in a real
+//          PPG, the counts dip as the arterial blood volume rises.
+static Trace syntheticTrace(float heartRate, float spo2, int seconds) {
+  Trace trace;
+  char name[32];
+  snprintf(name, sizeof(name), "syn-hr%.0f-spo2-%.0f", heartRate, spo2);
+  trace.name = name;
+  trace.synthetic = true;
+  trace.heartRate = heartRate;
+  trace.spo2 = spo2;
+
+  const float irDc = 110000, redDc = 85000, irAc = 0.01f;
+  float redAc = irAc * ratioForSpo2(spo2);
+  float period = 60.0f / heartRate;
+  for (int32_t k = 0; k < seconds * TRACE_FS; k++) {
+    float t = (float)k / TRACE_FS;
+    float phase = fmodf(t, period) / period;
+    float pulse = expf(-powf((phase - 0.2f) / 0.08f, 2)) +
+                  0.4f * expf(-powf((phase - 0.55f) / 0.1f, 2));
+    float wander = 0.004f * sinf(2 * (float)M_PI * 0.25f * t);
+    trace.ir.push_back(irDc * (1 - irAc * pulse + wander) + 15 * noise());
+    trace.red.push_back(redDc * (1 - redAc * pulse + wander) + 15 * noise());
+  }
+  return trace;
+}
+
+// Loads a recorded session
+// Parameters:
+//   - path: session file
+//   - trace: receives the samples and the label, if any
+// Returns: false if the file cannot be read
+static bool recordedTrace(const char *path, Trace *trace) {
+  trace->name = path;
+  trace->synthetic = false;
+  trace->heartRate = NAN;
+  trace->spo2 = NAN;
+
+  FILE *file = fopen(path, "r");
+  if (file == NULL) return false;
+  char text[128];
+  while (fgets(text, sizeof(text), file)) {
+    const char *hr = strstr(text, "hr=");
+    const char *spo2 = strstr(text, "spo2=");
+    if (text[0] == '#' && hr != NULL && spo2 != NULL) {
+      trace->heartRate = atof(hr + 3);
+      trace->spo2 = atof(spo2 + 5);
+      break;
+    }
+  }
+  fclose(file);
+
+  SessionReader reader;
+  if (!reader.open(path)) return false;
+  uint32_t ir[RFA_BUFFER_SIZE], red[RFA_BUFFER_SIZE];
+  int32_t n;
+  while ((n = reader.read(ir, red, RFA_BUFFER_SIZE)) > 0) {
+    trace->ir.insert(trace->ir.end(), ir, ir + n);
+    trace->red.insert(trace->red.end(), red, red + n);
+  }
+  return !reader.failed();
+}
+
+// Averages a channel down to a lower sampling frequency
+// Parameters:
+//   - samples: channel at TRACE_FS
+//   - fs: target sampling frequency, a divisor of TRACE_FS
+// Returns: the decimated channel
+static std::vector<uint32_t> decimate(const std::vector<uint32_t> &samples,
+                                      int32_t fs) {
+  int32_t factor = TRACE_FS / fs;
+  std::vector<uint32_t> out;
+  for (size_t i = 0; i + factor <= samples.size(); i += factor) {
+    uint64_t sum = 0;
+    for (int32_t j = 0; j < factor; j++) sum += samples[i + j];
+    out.push_back(sum / factor);
+  }
+  return out;
+}
+
+// Kernels in the kernel table
+enum KernelKind {
+  KERNEL_SORT,          // maxim_sort_ascend
+  KERNEL_SORT_INDICES,  // maxim_sort_indices_descend
+  KERNEL_FIR_SAMPLE,    // BeatDetector::lowPassFIRFilter, one call per sample
+  KERNEL_FIR_BLOCK,     // BeatDetector::lowPassFIRFilter, one call per window
+};
+
+// A small kernel called once or a few times per batch, timed on its own
+struct KernelCase {
+  const char *name;
+  KernelKind kind;
+  int32_t n;  // elements processed, the largest count a batch can produce
+};
+
+// Largest KernelCase::n
+static const int32_t maxKernelSize = RFA_BUFFER_SIZE;
+
+// Input orders the kernels are timed on; the slowest one is reported
+enum InputOrder { ORDER_ASCENDING, ORDER_DESCENDING, ORDER_EQUAL, ORDER_RANDOM };
+static const char *const orderNames[] = {"ascending", "descending", "equal",
+                                         "random"};
+
+// Times a kernel on one input order
+// Parameters:
+//   - kernel: kernel and size
+//   - order: order of the input values
+//   - calls: number of calls timed
+// Returns: nanoseconds per call, including a copy of the input
+static double timeKernel(const KernelCase &kernel, InputOrder order,
+                         long calls) {
+  int32_t values[maxKernelSize], work[maxKernelSize];
+  int16_t filterIn[maxKernelSize], filterOut[maxKernelSize];
+  BeatDetector detector;
+  for (int32_t i = 0; i < kernel.n; i++) {
+    switch (order) {
+      case ORDER_ASCENDING: values[i] = i; break;
+      case ORDER_DESCENDING: values[i] = kernel.n - i; break;
+      case ORDER_EQUAL: values[i] = 1; break;
+      case ORDER_RANDOM: values[i] = (int32_t)(noise() * 1000); break;
+    }
+    filterIn[i] = (int16_t)values[i];
+  }
+  // Keeps the compiler from dropping the calls
+  volatile int32_t sink = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (long call = 0; call < calls; call++) {
+    switch (kernel.kind) {
+      case KERNEL_SORT:
+        memcpy(work, values, kernel.n * sizeof(work[0]));
+        maxim_sort_ascend(work, kernel.n);
+        sink = sink + work[0];
+        break;
+      case KERNEL_SORT_INDICES:
+        for (int32_t i = 0; i < kernel.n; i++) work[i] = i;
+        maxim_sort_indices_descend(values, work, kernel.n);
+        sink = sink + work[0];
+        break;
+      case KERNEL_FIR_SAMPLE:
+        for (int32_t i = 0; i < kernel.n; i++) {
+          filterOut[i] = detector.lowPassFIRFilter(filterIn[i]);
+        }
+        sink = sink + filterOut[kernel.n - 1];
+        break;
+      case KERNEL_FIR_BLOCK:
+        detector.lowPassFIRFilter(filterIn, filterOut, kernel.n);
+        sink = sink + filterOut[kernel.n - 1];
+        break;
+    }
+  }
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+             .count() /
+         calls;
+}
+
+// Runs one case over a set of traces
+// Parameters:
+//   - benchCase: algorithm and setting
+//   - traces: traces to run over
+//   - repetitions: timing repetitions, accuracy is taken from the first
+// Returns: accumulated timing and accuracy
+static BenchResult runCase(const BenchCase &benchCase,
+                           const std::vector<const Trace *> &traces,
+                           int repetitions) {
+  BenchResult result = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  int32_t n = benchCase.fs * benchCase.st;
+
+  for (const Trace *trace : traces) {
+    std::vector<uint32_t> ir = decimate(trace->ir, benchCase.fs);
+    std::vector<uint32_t> red = decimate(trace->red, benchCase.fs);
+    bool labeled = !isnan(trace->heartRate);
+
+    for (int rep = 0; rep < repetitions; rep++) {
+      benchCase.estimator->reset();
+      unsigned long allocations = allocationCount();
+      long windows = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (size_t offset = 0; offset + n <= ir.size(); windows++) {
+        Estimate estimate;
+        int32_t used = benchCase.estimator->process(&ir[offset], &red[offset],
+                                                    n, &estimate);
+        offset += used;
+        result.samples += used;
+        if (rep == 0 && labeled) {
+          result.labeledWindows++;
+          if (estimate.hrValid) {
+            double error = fabs(estimate.heartRate - trace->heartRate);
+            result.hrReported++;
+            result.hrValid += error <= hrTolerance;
+            result.hrError += error;
+          }
+          if (estimate.spo2Valid) {
+            double error = fabs(estimate.spo2 - trace->spo2);
+            result.spo2Reported++;
+            result.spo2Valid += error <= spo2Tolerance;
+            result.spo2Error += error;
+          }
+        }
+      }
+      result.nanoseconds += std::chrono::duration<double, std::nano>(
+                                std::chrono::steady_clock::now() - start)
+                                .count();
+      result.allocations += allocationCount() - allocations;
+      result.windows += windows;
+    }
+  }
+  return result;
+}
+
+int main(int argc, char **argv) {
+  int repetitions = 20;
+  const char *jsonPath = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:o:h")) != -1) {
+    switch (opt) {
+      case 'n':
+        repetitions = atoi(optarg);
+        break;
+      case 'o':
+        jsonPath = optarg;
+        break;
+      default:
+        fprintf(stderr,
+                "Usage: ppg_bench [-n repetitions] [-o results.json] "
+                "[recorded...]\n");
+        return 2;
+    }
+  }
+  if (repetitions < 1) repetitions = 1;
+
+  std::vector<Trace> traces;
+  const float heartRates[] = {50, 70, 90, 120, 150};
+  const float spo2s[] = {97, 92};
+  for (float heartRate : heartRates) {
+    for (float spo2 : spo2s) {
+      traces.push_back(syntheticTrace(heartRate, spo2, 60));
+    }
+  }
+  std::vector<std::string> paths(argv + optind, argv + argc);
+  if (paths.empty()) {
+    // The sessions checked in next to the tools, build/../recorded
+    std::string self(argv[0]);
+    std::string pattern =
+        std::string(dirname(&self[0])) + "/../recorded/*.csv";
+    glob_t found;
+    if (glob(pattern.c_str(), 0, NULL, &found) == 0) {
+      paths.assign(found.gl_pathv, found.gl_pathv + found.gl_pathc);
+    }
+    globfree(&found);
+  }
+  for (const std::string &path : paths) {
+    Trace trace;
+    if (!recordedTrace(path.c_str(), &trace)) {
+      fprintf(stderr, "ppg_bench: cannot read %s\n", path.c_str());
+      return 1;
+    }
+    traces.push_back(trace);
+  }
+
+  std::vector<const Trace *> synthetic, recorded;
+  for (const Trace &trace : traces) {
+    (trace.synthetic ? synthetic : recorded).push_back(&trace);
+  }
+
+  RfEstimator rf;
+  AdaptiveRfEstimator rfAdaptive;
+  GoertzelEstimator goertzel;
+  MaximEstimator maxim25(MAXIM_FS), maxim50(50);
+  StreamingMaximEstimator maximStreamed25(MAXIM_FS), maximStreamed50(50);
+  PbaEstimator pba25(25), pba50(50);
+  const BenchCase cases[] = {
+      {&rf, FS, 2},
+      {&rf, FS, 3},
+      {&rf, FS, 4},
+      {&rfAdaptive, FS, ST},
+      {&goertzel, FS, 2},
+      {&goertzel, FS, 3},
+      {&goertzel, FS, 4},
+      {&maxim25, MAXIM_FS, MAXIM_ST},
+      {&maxim50, 50, MAXIM_ST},
+      {&maximStreamed25, MAXIM_FS, MAXIM_ST},
+      {&maximStreamed50, 50, MAXIM_ST},
+      {&pba25, 25, 4},
+      {&pba50, 50, 4},
+  };
+
+  FILE *json = NULL;
+  if (jsonPath != NULL) {
+    json = fopen(jsonPath, "w");
+    if (json == NULL) {
+      fprintf(stderr, "ppg_bench: cannot create %s\n", jsonPath);
+      return 1;
+    }
+    fprintf(json, "[\n");
+  }
+
+  printf("%-8s %4s %3s %-10s %8s %6s %12s %8s %8s %8s %9s %8s\n", "algo",
+         "fs", "st", "traces", "windows", "win_s", "ns/window", "alloc/w",
+         "hr_valid", "hr_mae", "spo2_valid", "spo2_mae");
+  bool first = true;
+  for (const BenchCase &benchCase : cases) {
+    for (int set = 0; set < 2; set++) {
+      const std::vector<const Trace *> &group = set ? recorded : synthetic;
+      if (group.empty()) continue;
+      BenchResult r = runCase(benchCase, group, repetitions);
+      double nsPerWindow = r.windows ? r.nanoseconds / r.windows : 0;
+      double windowSeconds =
+          r.windows ? (double)r.samples / r.windows / benchCase.fs : 0;
+      double allocsPerWindow =
+          r.windows ? (double)r.allocations / r.windows : 0;
+      double hrValid = r.labeledWindows ? (double)r.hrValid / r.labeledWindows
+                                        : NAN;
+      double hrMae = r.hrReported ? r.hrError / r.hrReported : NAN;
+      double spo2Valid =
+          r.labeledWindows ? (double)r.spo2Valid / r.labeledWindows : NAN;
+      double spo2Mae = r.spo2Reported ? r.spo2Error / r.spo2Reported : NAN;
+      const char *setName = set ? "recorded" : "synthetic";
+
+      printf(
+          "%-8s %4d %3d %-10s %8ld %6.2f %12.0f %8.2f %8.2f %8.2f %9.2f "
+          "%8.2f\n",
+          benchCase.estimator->name(), (int)benchCase.fs, (int)benchCase.st,
+          setName, r.windows / repetitions, windowSeconds, nsPerWindow,
+          allocsPerWindow, hrValid, hrMae, spo2Valid, spo2Mae);
+      if (json != NULL) {
+        // JSON has no NaN; unavailable metrics are written as null
+        auto number = [](double value) {
+          char text[32];
+          if (isnan(value)) return std::string("null");
+          snprintf(text, sizeof(text), "%.4f", value);
+          return std::string(text);
+        };
+        fprintf(json,
+                "%s  {\"algorithm\": \"%s\", \"fs\": %d, \"st\": %d, "
+                "\"traces\": \"%s\", \"windows\": %ld, \"window_s\": %s, "
+                "\"ns_per_window\": %s, "
+                "\"allocs_per_window\": %s, \"hr_valid\": %s, \"hr_mae\": %s, "
+                "\"spo2_valid\": %s, \"spo2_mae\": %s}",
+                first ? "" : ",\n", benchCase.estimator->name(),
+                (int)benchCase.fs, (int)benchCase.st, setName,
+                r.windows / repetitions, number(windowSeconds).c_str(),
+                number(nsPerWindow).c_str(),
+                number(allocsPerWindow).c_str(), number(hrValid).c_str(),
+                number(hrMae).c_str(), number(spo2Valid).c_str(),
+                number(spo2Mae).c_str());
+        first = false;
+      }
+    }
+  }
+
+  // The ratios are sorted for their median, the valleys by height and then
+  // by position. The beat detector filter is timed over a whole window.
+  const KernelCase kernels[] = {
+      {"maxim_sort_ratios", KERNEL_SORT, 5},
+      {"maxim_sort_peaks", KERNEL_SORT_INDICES, MAXIM_MAX_PEAKS},
+      {"maxim_sort_locs", KERNEL_SORT, MAXIM_MAX_PEAKS},
+      {"pba_fir_sample", KERNEL_FIR_SAMPLE, RFA_BUFFER_SIZE},
+      {"pba_fir_block", KERNEL_FIR_BLOCK, RFA_BUFFER_SIZE},
+  };
+  printf("\n%-18s %3s %-11s %12s\n", "kernel", "n", "worst_order",
+         "ns/call");
+  for (const KernelCase &kernel : kernels) {
+    double worst = 0;
+    int worstOrder = ORDER_ASCENDING;
+    for (int order = ORDER_ASCENDING; order <= ORDER_RANDOM; order++) {
+      double ns = timeKernel(kernel, (InputOrder)order, 10000L * repetitions);
+      if (ns > worst) {
+        worst = ns;
+        worstOrder = order;
+      }
+    }
+    printf("%-18s %3d %-11s %12.1f\n", kernel.name, (int)kernel.n,
+           orderNames[worstOrder], worst);
+    if (json != NULL) {
+      fprintf(json,
+              "%s  {\"kernel\": \"%s\", \"n\": %d, \"worst_order\": "
+              "\"%s\", \"ns_per_call\": %.2f}",
+              first ? "" : ",\n", kernel.name, (int)kernel.n,
+              orderNames[worstOrder], worst);
+      first = false;
+    }
+  }
+
+  if (json != NULL) {
+    fprintf(json, "\n]\n");
+    fclose(json);
+  }
+  return 0;
+}
@@ -0,0 +1,237 @@
+#include "ppg_engine.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+SessionReader::SessionReader()
+    : file(NULL), line(0), samples(0), error(false) {}
+
+SessionReader::~SessionReader() {
+  if (file != NULL) {
+    fclose(file);
+  }
+}
+
+bool SessionReader::open(const char *path) {
+  file = fopen(path, "r");
+  line = 0;
+  samples = 0;
+  error = false;
+  return file != NULL;
+}
+
+int32_t SessionReader::read(uint32_t *irBuffer, uint32_t *redBuffer,
+                            int32_t length) {
+  char text[128];
+  int32_t count = 0;
+
+  while (count < length && !error && fgets(text, sizeof(text), file)) {
+    line++;
+    char *p = text;
+    while (isspace((unsigned char)*p)) p++;
+    if (*p == '\0' || *p == '#') {
+      continue;
+    }
+    // A header line is only allowed before the first sample
+    if (!isdigit((unsigned char)*p) && samples == 0) {
+      continue;
+    }
+
+    char *end;
+    unsigned long ir = strtoul(p, &end, 10);
+    if (end == p || (*end != ',' && *end != ';' && !isspace((unsigned char)*end))) {
+      error = true;
+      break;
+    }
+    p = end + 1;
+    unsigned long red = strtoul(p, &end, 10);
+    if (end == p) {
+      error = true;
+      break;
+    }
+    while (isspace((unsigned char)*end)) end++;
+    if (*end != '\0') {
+      error = true;
+      break;
+    }
+    irBuffer[count] = (uint32_t)ir;
+    redBuffer[count] = (uint32_t)red;
+    count++;
+    samples++;
+  }
+  return count;
+}
+
+std::string validateOptions(const BatchOptions &options) {
+  if (options.windowLength < 2 || options.windowLength > RFA_BUFFER_SIZE) {
+    return "window length must be between 2 and " +
+           std::to_string(RFA_BUFFER_SIZE) + " samples";
+  }
+  if (options.engines == 0) {
+    return "no engine selected";
+  }
+  if (options.engines & ENGINE_MAXIM) {
+    // The Maxim algorithm runs on the same window, decimated to the rate
+    // its thresholds were tuned for
+    if (FS % MAXIM_FS != 0 ||
+        options.windowLength / (FS / MAXIM_FS) != MAXIM_BUFFER_SIZE) {
+      return "the Maxim engine needs windows of " +
+             std::to_string(MAXIM_BUFFER_SIZE * (FS / MAXIM_FS)) + " samples";
+    }
+  }
+  return "";
+}
+
+void processWindow(rf_state_t *state, EngineWorkspace *workspace,
+                   uint32_t *irBuffer, uint32_t *redBuffer,
+                   const BatchOptions &options, WindowResult *result) {
+  if (options.engines & ENGINE_RF) {
+    rf_heart_rate_and_oxygen_saturation_r(
+        state, &workspace->rf, irBuffer, options.windowLength, redBuffer,
+        &result->rfSpo2, &result->rfSpo2Valid, &result->rfHeartRate,
+        &result->rfHrValid, &result->rfRatio, &result->rfCorrel);
+    result->rfScreen = state->uch_last_screen;
+  }
+
+  if (options.engines & ENGINE_MAXIM) {
+    // Average groups of samples down to the Maxim sampling frequency
+    int32_t factor = FS / MAXIM_FS;
+    uint32_t irDecimated[RFA_BUFFER_SIZE];
+    uint32_t redDecimated[RFA_BUFFER_SIZE];
+    for (int32_t i = 0; i < MAXIM_BUFFER_SIZE; i++) {
+      uint32_t irSum = 0, redSum = 0;
+      for (int32_t j = 0; j < factor; j++) {
+        irSum += irBuffer[i * factor + j];
+        redSum += redBuffer[i * factor + j];
+      }
+      irDecimated[i] = irSum / factor;
+      redDecimated[i] = redSum / factor;
+    }
+    maxim_heart_rate_and_oxygen_saturation_r(
+        &workspace->maxim, MAXIM_FS, irDecimated, MAXIM_BUFFER_SIZE,
+        redDecimated, &result->maximSpo2, &result->maximSpo2Valid,
+        &result->maximHeartRate, &result->maximHrValid);
+  }
+}
+
+// Builds the result file path for a session
+// Parameters:
+//   - input: path of the session file
+//   - outputDir: result directory, empty to write next to the input
+// Returns: the result file path
+static std::string resultPath(const std::string &input,
+                              const std::string &outputDir) {
+  if (outputDir.empty()) {
+    return input + ".results.csv";
+  }
+  size_t slash = input.find_last_of('/');
+  std::string name =
+      (slash == std::string::npos) ? input : input.substr(slash + 1);
+  return outputDir + "/" + name + ".results.csv";
+}
+
+void processSession(const std::string &input, const BatchOptions &options,
+                    EngineWorkspace *workspace, SessionSummary *summary) {
+  uint32_t irBuffer[RFA_BUFFER_SIZE];
+  uint32_t redBuffer[RFA_BUFFER_SIZE];
+  rf_state_t state;
+  WindowResult result;
+
+  summary->input = input;
+  summary->output = resultPath(input, options.outputDir);
+  summary->windows = 0;
+  summary->rfValid = 0;
+  summary->rfRejected = 0;
+  summary->maximValid = 0;
+  summary->error.clear();
+
+  SessionReader reader;
+  if (!reader.open(input.c_str())) {
+    summary->error = "cannot open input";
+    return;
+  }
+  FILE *out = fopen(summary->output.c_str(), "w");
+  if (out == NULL) {
+    summary->error = "cannot create " + summary->output;
+    return;
+  }
+
+  fprintf(out, "window,start");
+  if (options.engines & ENGINE_RF) {
+    fprintf(out, ",rf_hr,rf_hr_valid,rf_spo2,rf_spo2_valid,rf_ratio,"
+                 "rf_correl,rf_screen");
+  }
+  if (options.engines & ENGINE_MAXIM) {
+    fprintf(out, ",maxim_hr,maxim_hr_valid,maxim_spo2,maxim_spo2_valid");
+  }
+  fprintf(out, "\n");
+
+  rf_init_state(&state);
+  // A trailing partial window is dropped
+  while (reader.read(irBuffer, redBuffer, options.windowLength) ==
+         options.windowLength) {
+    processWindow(&state, workspace, irBuffer, redBuffer, options, &result);
+
+    fprintf(out, "%d,%ld", (int)summary->windows,
+            (long)summary->windows * options.windowLength);
+    if (options.engines & ENGINE_RF) {
+      fprintf(out, ",%d,%d,%.2f,%d,%.4f,%.4f,%d", (int)result.rfHeartRate,
+              result.rfHrValid, result.rfSpo2, result.rfSpo2Valid,
+              result.rfRatio, result.rfCorrel, result.rfScreen);
+      if (result.rfHrValid && result.rfSpo2Valid) summary->rfValid++;
+      if (result.rfScreen != RF_SCREEN_OK) summary->rfRejected++;
+    }
+    if (options.engines & ENGINE_MAXIM) {
+      fprintf(out, ",%d,%d,%d,%d", (int)result.maximHeartRate,
+              result.maximHrValid, (int)result.maximSpo2,
+              result.maximSpo2Valid);
+      if (result.maximHrValid && result.maximSpo2Valid) summary->maximValid++;
+    }
+    fprintf(out, "\n");
+    summary->windows++;
+  }
+  fclose(out);
+
+  if (reader.failed()) {
+    summary->error =
+        "malformed sample on line " + std::to_string(reader.lineNumber());
+  }
+}
+
+std::vector<SessionSummary> runBatch(const std::vector<std::string> &inputs,
+                                     const BatchOptions &options) {
+  std::vector<SessionSummary> summaries(inputs.size());
+  std::atomic<size_t> next(0);
+
+  size_t threads = options.threads;
+  if (threads == 0) {
+    threads = std::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+  }
+  if (threads > inputs.size()) {
+    threads = inputs.size();
+  }
+
+  // Sessions are handed out one at a time, so long and short recordings
+  // balance across workers. Each worker owns its engine workspace.
+  auto worker = [&]() {
+    std::unique_ptr<EngineWorkspace> workspace(new EngineWorkspace);
+    for (size_t i = next++; i < inputs.size(); i = next++) {
+      processSession(inputs[i], options, workspace.get(), &summaries[i]);
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (size_t i = 1; i < threads; i++) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : pool) {
+    thread.join();
+  }
+  return summaries;
+}
@@ -0,0 +1,127 @@
+// Host-side batch reprocessing of recorded PPG sessions.
+//
+// A session is a text file with one "ir,red" pair of raw sensor counts per
+// line, sampled at FS (see algorithm_by_RF.h). Blank lines, lines starting
+// with '#' and a leading non-numeric header line are skipped. Sessions are
+// streamed window by window and each gets its own estimator state, so any
+// number of them can be processed in parallel.
+#ifndef PPG_ENGINE_H_
+#define PPG_ENGINE_H_
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "algorithm_by_RF.h"
+#include "spo2_algorithm.h"
+
+// Estimators that can be run over a session, combined as a bitmask
+enum Engine { ENGINE_RF = 1, ENGINE_MAXIM = 2 };
+
+// Settings shared by every session of a batch run
+struct BatchOptions {
+  int threads;            // worker threads, 0 = one per core
+  int32_t windowLength;   // samples per window, at most RFA_BUFFER_SIZE
+  int engines;            // bitmask of Engine values
+  std::string outputDir;  // where result files go, empty = next to the input
+};
+
+// Results of every engine for one window
+struct WindowResult {
+  int32_t rfHeartRate;
+  int8_t rfHrValid;
+  float rfSpo2;
+  int8_t rfSpo2Valid;
+  float rfRatio;
+  float rfCorrel;
+  uint8_t rfScreen;
+  int32_t maximHeartRate;
+  int8_t maximHrValid;
+  int32_t maximSpo2;
+  int8_t maximSpo2Valid;
+};
+
+// Outcome of processing one session
+struct SessionSummary {
+  std::string input;
+  std::string output;
+  int32_t windows;
+  int32_t rfValid;
+  int32_t rfRejected;
+  int32_t maximValid;
+  std::string error;  // empty on success
+};
+
+// Streams samples from a session file
+class SessionReader {
+ public:
+  SessionReader();
+  ~SessionReader();
+
+  // Opens a session file
+  // Returns: false if the file cannot be opened
+  bool open(const char *path);
+
+  // Reads the next samples of the session
+  // Parameters:
+  //   - irBuffer, redBuffer: receive up to length samples each
+  //   - length: number of samples wanted
+  // Returns: the number of samples read, less than length at the end of the
+  //          file or on a malformed line (see failed())
+  int32_t read(uint32_t *irBuffer, uint32_t *redBuffer, int32_t length);
+
+  // Returns: true if a malformed line stopped reading
+  bool failed() const { return error; }
+
+  // Returns: the number of the last line read
+  long lineNumber() const { return line; }
+
+ private:
+  FILE *file;
+  long line;
+  long samples;
+  bool error;
+};
+
+// Scratch memory of the engines, one per worker thread
+struct EngineWorkspace {
+  rf_workspace_t rf;
+  maxim_workspace_t maxim;
+};
+
+// Checks options against what the engines support
+// Returns: an error message, or an empty string if the options are usable
+std::string validateOptions(const BatchOptions &options);
+
+// Runs the selected engines over one window
+// Parameters:
+//   - state: RF estimator state of the session the window belongs to
+//   - workspace: engine scratch memory owned by the calling thread
+//   - irBuffer, redBuffer: options.windowLength raw samples at FS
+//   - options: batch settings
+//   - result: receives the results
+// No return value
+void processWindow(rf_state_t *state, EngineWorkspace *workspace,
+                   uint32_t *irBuffer, uint32_t *redBuffer,
+                   const BatchOptions &options, WindowResult *result);
+
+// Processes a whole session and writes its per-window result file
+// Parameters:
+//   - input: path of the session file
+//   - options: batch settings
+//   - workspace: engine scratch memory owned by the calling thread
+//   - summary: receives the outcome
+// No return value
+void processSession(const std::string &input, const BatchOptions &options,
+                    EngineWorkspace *workspace, SessionSummary *summary);
+
+// Processes sessions on a pool of worker threads
+// Parameters:
+//   - inputs: paths of the session files
+//   - options: batch settings, see validateOptions()
+// Returns: one summary per input, in input order
+std::vector<SessionSummary> runBatch(const std::vector<std::string> &inputs,
+                                     const BatchOptions &options);
+
+#endif /* PPG_ENGINE_H_ */